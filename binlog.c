@@ -26,9 +26,9 @@
 #include <mysqld_error.h>
 #include <sql_common.h>
 #include <string.h>
-#include <zlib.h>
 #include "mydumper.h"
 #include "binlog.h"
+#include "codec.h"
 
 #define BINLOG_MAGIC "\xfe\x62\x69\x6e"
 
@@ -51,12 +51,14 @@ enum event_type {
 	EVENT_TOO_SHORT= 254 // arbitrary high number, in 5.1 the max event type number is 27 so this should be fine for a while
 };
 
-extern int compress_output;
+extern enum codec_type output_codec;
+extern int compress_level;
+extern guint compress_threads;
 extern gboolean daemon_mode;
 extern gboolean shutdown_triggered;
 
-FILE *new_binlog_file(char *binlog_file, const char *binlog_dir);
-void close_binlog_file(FILE *outfile);
+struct codec_file *new_binlog_file(char *binlog_file, const char *binlog_dir);
+void close_binlog_file(struct codec_file *outfile);
 char *rotate_file_name(const char *buf);
 
 void get_binlogs(MYSQL *conn, struct configuration *conf) {
@@ -124,7 +126,7 @@ void get_binlog_file(MYSQL *conn, char *binlog_file, const char *binlog_director
 	NET* net;
 	net= &conn->net;
 	unsigned long len;
-	FILE* outfile;
+	struct codec_file *outfile;
 	guint32 event_type;
 	gboolean read_error= FALSE;
 	gboolean read_end= FALSE;
@@ -232,27 +234,19 @@ char *rotate_file_name(const char *buf) {
 	return g_strndup(&buf[EVENT_HEADER_LENGTH + EVENT_ROTATE_FIXED_LENGTH], event_length);
 }
 
-FILE *new_binlog_file(char *binlog_file, const char *binlog_dir) {
-	FILE *outfile;
+struct codec_file *new_binlog_file(char *binlog_file, const char *binlog_dir) {
+	struct codec_file *outfile;
 	char* filename;
 
-	if (!compress_output) {
-		filename= g_strdup_printf("%s/%s", binlog_dir, binlog_file);
-		outfile= g_fopen(filename, "w");
-	} else {
-		filename= g_strdup_printf("%s/%s.gz", binlog_dir, binlog_file);
-		outfile= (void*) gzopen(filename, "w");
-	}
+	filename= g_strdup_printf("%s/%s%s", binlog_dir, binlog_file, codec_extension(output_codec));
+	outfile= codec_open(filename, "w", output_codec, compress_level, compress_threads);
 	g_free(filename);
 
 	return outfile;
 }
 
-void close_binlog_file(FILE *outfile) {
-	if (!compress_output)
-		fclose(outfile);
-	else
-		gzclose((gzFile) outfile);
+void close_binlog_file(struct codec_file *outfile) {
+	codec_close(outfile);
 }
 
 unsigned int get_event(const char *buf, unsigned int len) {
@@ -263,22 +257,7 @@ unsigned int get_event(const char *buf, unsigned int len) {
 	// TODO: Would be good if we can check for valid event type, unfortunately this check can change from version to version
 }
 
-void write_binlog(FILE* file, const char* data, guint64 len) {
-	int err;
-
-	if (len > 0) {
-		int write_result;
-
-		if (!compress_output)
-			write_result= write(fileno(file), data, len);
-		else
-			write_result= gzwrite((gzFile)file, data, len);
-
-		if (write_result <= 0)	{
-			if (!compress_output)
-				g_critical("Error: binlog: Error writing binary log: %s", strerror(errno));
-			else
-				g_critical("Error: binlog: Error writing compressed binary log: %s", gzerror((gzFile)file, &err));
-		}
-	}
+void write_binlog(struct codec_file *file, const char* data, guint64 len) {
+	if (len > 0 && !codec_write(file, data, len))
+		g_critical("Error: binlog: Error writing binary log: %s", codec_error(file));
 }
@@ -0,0 +1,26 @@
+# - Try to find the LZ4 compression library
+# Once done this will define
+#
+#  LZ4_FOUND - system has the lz4 library
+#  LZ4_INCLUDE_DIR - the lz4 include directory
+#  LZ4_LIBRARIES - The libraries needed to use lz4
+
+if (LZ4_INCLUDE_DIR AND LZ4_LIBRARIES)
+  # Already in cache, be silent
+  set(LZ4_FIND_QUIETLY TRUE)
+endif (LZ4_INCLUDE_DIR AND LZ4_LIBRARIES)
+
+if (NOT WIN32)
+  find_package(PkgConfig)
+  pkg_check_modules(PC_LZ4 liblz4)
+endif (NOT WIN32)
+
+find_path(LZ4_INCLUDE_DIR lz4frame.h
+          HINTS ${PC_LZ4_INCLUDEDIR} ${PC_LZ4_INCLUDE_DIRS})
+
+find_library(LZ4_LIBRARIES NAMES lz4 HINTS ${PC_LZ4_LIBDIR} ${PC_LZ4_LIBRARY_DIRS})
+
+include(FindPackageHandleStandardArgs)
+find_package_handle_standard_args(LZ4 DEFAULT_MSG LZ4_INCLUDE_DIR LZ4_LIBRARIES)
+
+mark_as_advanced(LZ4_INCLUDE_DIR LZ4_LIBRARIES)
@@ -0,0 +1,26 @@
+# - Try to find the Zstandard compression library
+# Once done this will define
+#
+#  ZSTD_FOUND - system has the zstd library
+#  ZSTD_INCLUDE_DIR - the zstd include directory
+#  ZSTD_LIBRARIES - The libraries needed to use zstd
+
+if (ZSTD_INCLUDE_DIR AND ZSTD_LIBRARIES)
+  # Already in cache, be silent
+  set(ZSTD_FIND_QUIETLY TRUE)
+endif (ZSTD_INCLUDE_DIR AND ZSTD_LIBRARIES)
+
+if (NOT WIN32)
+  find_package(PkgConfig)
+  pkg_check_modules(PC_ZSTD libzstd)
+endif (NOT WIN32)
+
+find_path(ZSTD_INCLUDE_DIR zstd.h
+          HINTS ${PC_ZSTD_INCLUDEDIR} ${PC_ZSTD_INCLUDE_DIRS})
+
+find_library(ZSTD_LIBRARIES NAMES zstd HINTS ${PC_ZSTD_LIBDIR} ${PC_ZSTD_LIBRARY_DIRS})
+
+include(FindPackageHandleStandardArgs)
+find_package_handle_standard_args(ZSTD DEFAULT_MSG ZSTD_INCLUDE_DIR ZSTD_LIBRARIES)
+
+mark_as_advanced(ZSTD_INCLUDE_DIR ZSTD_LIBRARIES)
@@ -0,0 +1,965 @@
+/* 
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "config.h"
+#ifdef WITH_ZSTD
+#include <zstd.h>
+#include <zdict.h>
+#endif
+#ifdef WITH_LZ4
+#include <lz4frame.h>
+#endif
+#include "codec.h"
+
+/* LZ4 is fed in pieces of this size so its output buffer stays small */
+#define LZ4_CHUNK_SIZE 65536
+/* Same default dictionary size as the zstd command line tool */
+#define DICT_SIZE 112640
+/* gzip output is written in pieces of this size, gzwrite() would use 8KB */
+#define GZIP_BUFFER_SIZE (128 * 1024)
+/* LZ4's largest acceleration, blocks that don't compress are stored as they are */
+#define LZ4_STORE_LEVEL (-65537)
+
+struct codec_dict {
+	char *data;
+	gsize size;
+#ifdef WITH_ZSTD
+	ZSTD_CDict *cdict;
+	ZSTD_DDict *ddict;
+#endif
+};
+
+struct codec_file {
+	enum codec_type type;
+	FILE *file;
+	gzFile gz;
+	gboolean eof;
+	const char *error;
+	/* zstd and lz4: compressed data on its way to or from the file */
+	char *buffer;
+	gsize buffer_size;
+	gsize in_len;
+	gsize in_pos;
+	/* zstd and lz4 reading: decompressed data waiting for codec_gets() */
+	char *plain;
+	gsize plain_size;
+	gsize plain_len;
+	gsize plain_pos;
+	gboolean frame_open;
+	gboolean output_full;
+	/* writing */
+	z_stream zs;
+	int level;
+	GTimer *timer;
+	struct codec_stats stats;
+	gsize sync_bytes;
+	guint64 unsynced;
+	guint64 total_in;
+	guint64 total_out;
+#ifdef WITH_ZSTD
+	ZSTD_CCtx *cctx;
+	ZSTD_DCtx *dctx;
+	struct codec_dict *dict;
+	gboolean started;
+#endif
+#ifdef WITH_LZ4
+	LZ4F_cctx *lz4c;
+	LZ4F_dctx *lz4d;
+#endif
+};
+
+struct codec_block {
+	enum codec_type type;
+	int level;
+	z_stream zs;
+#ifdef WITH_ZSTD
+	ZSTD_CCtx *cctx;
+#endif
+#ifdef WITH_LZ4
+	LZ4F_preferences_t prefs;
+#endif
+};
+
+static const char *codec_names[CODEC_COUNT]= { "none", "gzip", "zstd", "lz4" };
+static const char *codec_extensions[CODEC_COUNT]= { "", ".gz", ".zst", ".lz4" };
+
+static gboolean codec_available(enum codec_type type) {
+	switch (type) {
+		case CODEC_ZSTD:
+#ifdef WITH_ZSTD
+			return TRUE;
+#else
+			return FALSE;
+#endif
+		case CODEC_LZ4:
+#ifdef WITH_LZ4
+			return TRUE;
+#else
+			return FALSE;
+#endif
+		default:
+			return TRUE;
+	}
+}
+
+gboolean codec_from_name(const char *name, enum codec_type *type) {
+	int i;
+
+	for (i= 0; i < CODEC_COUNT; i++) {
+		if (!g_ascii_strcasecmp(name, codec_names[i])) {
+			if (!codec_available((enum codec_type)i)) {
+				g_critical("This build has no %s support, rebuild with -DWITH_%s=ON", codec_names[i], i == CODEC_ZSTD ? "ZSTD" : "LZ4");
+				return FALSE;
+			}
+			*type= (enum codec_type)i;
+			return TRUE;
+		}
+	}
+	g_critical("Unknown compression format: %s", name);
+	return FALSE;
+}
+
+const char *codec_extension(enum codec_type type) {
+	return codec_extensions[type];
+}
+
+enum codec_type codec_for_path(const char *path) {
+	int i;
+
+	for (i= CODEC_NONE + 1; i < CODEC_COUNT; i++)
+		if (g_str_has_suffix(path, codec_extensions[i]))
+			return (enum codec_type)i;
+	return CODEC_NONE;
+}
+
+void codec_level_range(enum codec_type type, int *fastest, int *start, int *best) {
+	switch (type) {
+		case CODEC_GZIP:
+			/* What Z_DEFAULT_COMPRESSION stands for */
+			*fastest= 1;
+			*start= 6;
+			*best= 9;
+			break;
+		case CODEC_ZSTD:
+			/* Levels above 19 need --ultra with the zstd tool, too much memory to decompress */
+			*fastest= 1;
+#ifdef WITH_ZSTD
+			*start= ZSTD_CLEVEL_DEFAULT;
+#else
+			*start= 3;
+#endif
+			*best= 19;
+			break;
+		case CODEC_LZ4:
+			/* 3 and up switch to the high compression mode */
+			*fastest= 0;
+			*start= 0;
+			*best= 12;
+			break;
+		default:
+			*fastest= *start= *best= 0;
+	}
+}
+
+int codec_store_level(enum codec_type type) {
+	switch (type) {
+		case CODEC_GZIP:
+			return Z_NO_COMPRESSION;
+#ifdef WITH_ZSTD
+		case CODEC_ZSTD:
+			return ZSTD_minCLevel();
+#endif
+		case CODEC_LZ4:
+			return LZ4_STORE_LEVEL;
+		default:
+			return 0;
+	}
+}
+
+/* level -1 picks the format default */
+static int resolve_level(enum codec_type type, int level) {
+	int fastest, start, best;
+
+	if (level >= 0)
+		return type == CODEC_GZIP ? MIN(level, 9) : level;
+	codec_level_range(type, &fastest, &start, &best);
+	return start;
+}
+
+static gboolean write_out(struct codec_file *cf, const char *data, gsize len) {
+	gdouble start;
+
+	if (!len)
+		return TRUE;
+	start= g_timer_elapsed(cf->timer, NULL);
+	if (fwrite(data, 1, len, cf->file) != len) {
+		cf->error= g_strerror(errno);
+		return FALSE;
+	}
+	/* Without it writing only takes the time to copy into the page cache */
+	if (cf->sync_bytes && (cf->unsynced+= len) >= cf->sync_bytes) {
+		if (fflush(cf->file) || fdatasync(fileno(cf->file))) {
+			cf->error= g_strerror(errno);
+			return FALSE;
+		}
+		cf->unsynced= 0;
+	}
+	cf->stats.io_seconds+= g_timer_elapsed(cf->timer, NULL) - start;
+	cf->stats.out_bytes+= len;
+	cf->total_out+= len;
+	return TRUE;
+}
+
+static gboolean write_buffer(struct codec_file *cf, gsize len) {
+	return write_out(cf, cf->buffer, len);
+}
+
+static gboolean gzip_open(struct codec_file *cf) {
+	/* windowBits 15 + 16 writes a gzip header and trailer, appending to a file starts a new member */
+	if (deflateInit2(&cf->zs, cf->level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		return FALSE;
+	cf->buffer_size= GZIP_BUFFER_SIZE;
+	cf->buffer= g_malloc(cf->buffer_size);
+	return TRUE;
+}
+
+/* Pushes data through deflate, Z_FINISH also ends the gzip member */
+static gboolean gzip_compress(struct codec_file *cf, const char *data, gsize len, int flush) {
+	gsize chunk;
+	gboolean last;
+	int r;
+
+	do {
+		/* avail_in is an unsigned int */
+		chunk= MIN(len, G_MAXINT);
+		cf->zs.next_in= (Bytef *)data;
+		cf->zs.avail_in= chunk;
+		data+= chunk;
+		len-= chunk;
+		last= len == 0;
+		do {
+			cf->zs.next_out= (Bytef *)cf->buffer;
+			cf->zs.avail_out= cf->buffer_size;
+			r= deflate(&cf->zs, last ? flush : Z_NO_FLUSH);
+			if (r == Z_STREAM_ERROR) {
+				cf->error= cf->zs.msg ? cf->zs.msg : "deflate failed";
+				return FALSE;
+			}
+			if (!write_buffer(cf, cf->buffer_size - cf->zs.avail_out))
+				return FALSE;
+		} while (cf->zs.avail_out == 0 || (last && flush == Z_FINISH && r != Z_STREAM_END));
+	} while (!last);
+
+	return TRUE;
+}
+
+#ifdef WITH_ZSTD
+static gboolean zstd_open(struct codec_file *cf, gboolean reading, int level, int threads) {
+	if (reading) {
+		cf->dctx= ZSTD_createDCtx();
+		cf->buffer_size= ZSTD_DStreamInSize();
+		cf->plain_size= ZSTD_DStreamOutSize();
+		cf->plain= g_malloc(cf->plain_size);
+	} else {
+		cf->cctx= ZSTD_createCCtx();
+		cf->buffer_size= ZSTD_CStreamOutSize();
+		if (cf->cctx)
+			ZSTD_CCtx_setParameter(cf->cctx, ZSTD_c_compressionLevel, level);
+		/* Fails on a libzstd built without threads, compression just stays in this thread then */
+		if (cf->cctx && threads > 0 && ZSTD_isError(ZSTD_CCtx_setParameter(cf->cctx, ZSTD_c_nbWorkers, threads)))
+			g_warning("libzstd has no multithreading support, compressing in a single thread");
+	}
+	cf->buffer= g_malloc(cf->buffer_size);
+	return reading ? cf->dctx != NULL : cf->cctx != NULL;
+}
+
+/* Pushes data through the compressor, ZSTD_e_end also finishes the frame */
+static gboolean zstd_compress(struct codec_file *cf, const char *data, gsize len, ZSTD_EndDirective op) {
+	ZSTD_inBuffer in= { data, len, 0 };
+	ZSTD_outBuffer out;
+	size_t remaining;
+
+	do {
+		out.dst= cf->buffer;
+		out.size= cf->buffer_size;
+		out.pos= 0;
+		remaining= ZSTD_compressStream2(cf->cctx, &out, &in, op);
+		if (ZSTD_isError(remaining)) {
+			cf->error= ZSTD_getErrorName(remaining);
+			return FALSE;
+		}
+		if (!write_buffer(cf, out.pos))
+			return FALSE;
+	} while (op == ZSTD_e_end ? remaining != 0 : in.pos < in.size);
+	cf->frame_open= op != ZSTD_e_end;
+
+	return TRUE;
+}
+
+static gboolean zstd_decompress(struct codec_file *cf) {
+	ZSTD_inBuffer in= { cf->buffer, cf->in_len, cf->in_pos };
+	ZSTD_outBuffer out= { cf->plain, cf->plain_size, 0 };
+	size_t r;
+
+	/* All frames of a file are written the same way, the first one tells whether the dictionary was used.
+	   It must not be loaded for frames written without it */
+	if (!cf->started) {
+		cf->started= TRUE;
+		if (cf->dict && ZSTD_getDictID_fromFrame(cf->buffer, cf->in_len))
+			ZSTD_DCtx_refDDict(cf->dctx, cf->dict->ddict);
+	}
+
+	r= ZSTD_decompressStream(cf->dctx, &out, &in);
+	if (ZSTD_isError(r)) {
+		cf->error= ZSTD_getErrorName(r);
+		return FALSE;
+	}
+	cf->in_pos= in.pos;
+	/* 0 means a frame just ended, another one may follow */
+	cf->frame_open= r != 0;
+	cf->output_full= out.pos == out.size;
+	cf->plain_len= out.pos;
+	return TRUE;
+}
+#endif
+
+#ifdef WITH_LZ4
+static void lz4_preferences(LZ4F_preferences_t *prefs, int level) {
+	memset(prefs, 0, sizeof(LZ4F_preferences_t));
+	prefs->compressionLevel= level;
+}
+
+static gboolean lz4_open(struct codec_file *cf, gboolean reading) {
+	LZ4F_preferences_t prefs;
+
+	if (reading) {
+		if (LZ4F_isError(LZ4F_createDecompressionContext(&cf->lz4d, LZ4F_VERSION)))
+			return FALSE;
+		cf->buffer_size= LZ4_CHUNK_SIZE;
+		cf->plain_size= 4 * LZ4_CHUNK_SIZE;
+		cf->plain= g_malloc(cf->plain_size);
+		cf->buffer= g_malloc(cf->buffer_size);
+		return TRUE;
+	}
+
+	if (LZ4F_isError(LZ4F_createCompressionContext(&cf->lz4c, LZ4F_VERSION)))
+		return FALSE;
+	lz4_preferences(&prefs, cf->level);
+	/* The bound covers data buffered inside the context and the frame footer too */
+	cf->buffer_size= MAX(LZ4F_compressBound(LZ4_CHUNK_SIZE, &prefs), LZ4F_HEADER_SIZE_MAX);
+	cf->buffer= g_malloc(cf->buffer_size);
+	return TRUE;
+}
+
+/* Frames start with the first write, so the level can still change before it */
+static gboolean lz4_begin(struct codec_file *cf) {
+	LZ4F_preferences_t prefs;
+	size_t r;
+
+	lz4_preferences(&prefs, cf->level);
+	r= LZ4F_compressBegin(cf->lz4c, cf->buffer, cf->buffer_size, &prefs);
+	if (LZ4F_isError(r)) {
+		cf->error= LZ4F_getErrorName(r);
+		return FALSE;
+	}
+	cf->frame_open= TRUE;
+	return write_buffer(cf, r);
+}
+
+static gboolean lz4_compress(struct codec_file *cf, const char *data, gsize len) {
+	gsize chunk;
+	size_t r;
+
+	if (!cf->frame_open && !lz4_begin(cf))
+		return FALSE;
+	while (len) {
+		chunk= MIN(len, LZ4_CHUNK_SIZE);
+		r= LZ4F_compressUpdate(cf->lz4c, cf->buffer, cf->buffer_size, data, chunk, NULL);
+		if (LZ4F_isError(r)) {
+			cf->error= LZ4F_getErrorName(r);
+			return FALSE;
+		}
+		if (!write_buffer(cf, r))
+			return FALSE;
+		data+= chunk;
+		len-= chunk;
+	}
+	return TRUE;
+}
+
+static gboolean lz4_end(struct codec_file *cf) {
+	size_t r;
+
+	/* A file with nothing written still gets an empty frame */
+	if (!cf->frame_open && !lz4_begin(cf))
+		return FALSE;
+	r= LZ4F_compressEnd(cf->lz4c, cf->buffer, cf->buffer_size, NULL);
+	cf->frame_open= FALSE;
+	if (LZ4F_isError(r)) {
+		cf->error= LZ4F_getErrorName(r);
+		return FALSE;
+	}
+	return write_buffer(cf, r);
+}
+
+static gboolean lz4_decompress(struct codec_file *cf) {
+	size_t dst_size= cf->plain_size;
+	size_t src_size= cf->in_len - cf->in_pos;
+	size_t r;
+
+	r= LZ4F_decompress(cf->lz4d, cf->plain, &dst_size, cf->buffer + cf->in_pos, &src_size, NULL);
+	if (LZ4F_isError(r)) {
+		cf->error= LZ4F_getErrorName(r);
+		return FALSE;
+	}
+	cf->in_pos+= src_size;
+	/* 0 means a frame just ended, the context starts on the next one by itself */
+	cf->frame_open= r != 0;
+	cf->output_full= dst_size == cf->plain_size;
+	cf->plain_len= dst_size;
+	return TRUE;
+}
+#endif
+
+/* Decompresses the next piece of the file into the plain buffer, FALSE at the end of the file */
+static gboolean fill_plain(struct codec_file *cf) {
+	gboolean r= FALSE;
+
+	cf->plain_len= cf->plain_pos= 0;
+	while (!cf->plain_len) {
+		/* A full output buffer may leave decompressed data behind in the context, drain that first */
+		if (cf->in_pos == cf->in_len && !cf->output_full) {
+			cf->in_len= fread(cf->buffer, 1, cf->buffer_size, cf->file);
+			cf->in_pos= 0;
+			if (!cf->in_len) {
+				if (ferror(cf->file))
+					cf->error= g_strerror(errno);
+				else if (cf->frame_open)
+					cf->error= "truncated compressed file";
+				else
+					cf->eof= TRUE;
+				return FALSE;
+			}
+		}
+		switch (cf->type) {
+#ifdef WITH_ZSTD
+			case CODEC_ZSTD:
+				r= zstd_decompress(cf);
+				break;
+#endif
+#ifdef WITH_LZ4
+			case CODEC_LZ4:
+				r= lz4_decompress(cf);
+				break;
+#endif
+			default:
+				break;
+		}
+		if (!r)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static char *buffered_gets(struct codec_file *cf, char *buf, int len) {
+	int n= 0;
+	char *nl;
+	gsize chunk;
+
+	while (n < len - 1) {
+		if (cf->plain_pos == cf->plain_len && !fill_plain(cf))
+			break;
+		chunk= MIN(cf->plain_len - cf->plain_pos, (gsize)(len - 1 - n));
+		nl= memchr(cf->plain + cf->plain_pos, '\n', chunk);
+		if (nl)
+			chunk= nl - (cf->plain + cf->plain_pos) + 1;
+		memcpy(buf + n, cf->plain + cf->plain_pos, chunk);
+		cf->plain_pos+= chunk;
+		n+= chunk;
+		if (nl)
+			break;
+	}
+	buf[n]= '\0';
+
+	return (n || !(cf->eof || cf->error)) ? buf : NULL;
+}
+
+struct codec_file *codec_open(const char *path, const char *mode, enum codec_type type, int level, int threads) {
+	struct codec_file *cf;
+	gboolean reading= mode[0] == 'r';
+	gboolean opened= TRUE;
+
+	(void) threads;
+	if (!codec_available(type)) {
+		g_critical("Cannot open %s, this build has no %s support", path, codec_names[type]);
+		errno= ENOTSUP;
+		return NULL;
+	}
+
+	cf= g_new0(struct codec_file, 1);
+	cf->type= type;
+	if (type == CODEC_GZIP && reading) {
+		if (!(cf->gz= gzopen(path, "rb"))) {
+			g_free(cf);
+			return NULL;
+		}
+		return cf;
+	}
+
+	if (!(cf->file= g_fopen(path, reading ? "rb" : (mode[0] == 'a' ? "ab" : "wb")))) {
+		g_free(cf);
+		return NULL;
+	}
+	if (!reading) {
+		cf->level= resolve_level(type, level);
+		cf->timer= g_timer_new();
+	}
+	switch (type) {
+		case CODEC_GZIP:
+			opened= gzip_open(cf);
+			break;
+#ifdef WITH_ZSTD
+		case CODEC_ZSTD:
+			opened= zstd_open(cf, reading, cf->level, threads);
+			break;
+#endif
+#ifdef WITH_LZ4
+		case CODEC_LZ4:
+			opened= lz4_open(cf, reading);
+			break;
+#endif
+		default:
+			break;
+	}
+	if (!opened) {
+		codec_close(cf);
+		errno= ENOMEM;
+		return NULL;
+	}
+	return cf;
+}
+
+static gboolean compress_data(struct codec_file *cf, const char *data, gsize len) {
+	switch (cf->type) {
+		case CODEC_GZIP:
+			return gzip_compress(cf, data, len, Z_NO_FLUSH);
+#ifdef WITH_ZSTD
+		case CODEC_ZSTD:
+			return zstd_compress(cf, data, len, ZSTD_e_continue);
+#endif
+#ifdef WITH_LZ4
+		case CODEC_LZ4:
+			return lz4_compress(cf, data, len);
+#endif
+		default:
+			return write_out(cf, data, len);
+	}
+}
+
+gboolean codec_write(struct codec_file *cf, const char *data, gsize len) {
+	gdouble start= g_timer_elapsed(cf->timer, NULL);
+	gdouble io_seconds= cf->stats.io_seconds;
+	gboolean r= compress_data(cf, data, len);
+
+	/* Whatever wasn't spent writing out was spent compressing */
+	cf->stats.in_bytes+= len;
+	cf->total_in+= len;
+	cf->stats.compress_seconds+= g_timer_elapsed(cf->timer, NULL) - start - (cf->stats.io_seconds - io_seconds);
+	return r;
+}
+
+char *codec_gets(struct codec_file *cf, char *buf, int len) {
+	int err;
+	char *r;
+
+	switch (cf->type) {
+		case CODEC_GZIP:
+			r= gzgets(cf->gz, buf, len);
+			if (!r && !gzeof(cf->gz))
+				cf->error= gzerror(cf->gz, &err);
+			return r;
+		case CODEC_ZSTD:
+		case CODEC_LZ4:
+			return buffered_gets(cf, buf, len);
+		default:
+			r= fgets(buf, len, cf->file);
+			if (!r && ferror(cf->file))
+				cf->error= g_strerror(errno);
+			return r;
+	}
+}
+
+gboolean codec_eof(struct codec_file *cf) {
+	switch (cf->type) {
+		case CODEC_GZIP:
+			return gzeof(cf->gz);
+		case CODEC_ZSTD:
+		case CODEC_LZ4:
+			return cf->eof;
+		default:
+			return feof(cf->file);
+	}
+}
+
+const char *codec_error(struct codec_file *cf) {
+	return cf->error ? cf->error : "unknown error";
+}
+
+int codec_close(struct codec_file *cf) {
+	int r= 0;
+
+	if (cf->gz) {
+		r= gzclose(cf->gz);
+		g_free(cf);
+		return r;
+	}
+
+	switch (cf->type) {
+		case CODEC_GZIP:
+			/* The stream is only there if deflateInit2() worked */
+			if (cf->zs.state && !gzip_compress(cf, NULL, 0, Z_FINISH))
+				r= -1;
+			deflateEnd(&cf->zs);
+			break;
+#ifdef WITH_ZSTD
+		case CODEC_ZSTD:
+			if (cf->cctx && !zstd_compress(cf, NULL, 0, ZSTD_e_end))
+				r= -1;
+			ZSTD_freeCCtx(cf->cctx);
+			ZSTD_freeDCtx(cf->dctx);
+			break;
+#endif
+#ifdef WITH_LZ4
+		case CODEC_LZ4:
+			if (cf->lz4c && !lz4_end(cf))
+				r= -1;
+			if (cf->lz4c)
+				LZ4F_freeCompressionContext(cf->lz4c);
+			if (cf->lz4d)
+				LZ4F_freeDecompressionContext(cf->lz4d);
+			break;
+#endif
+		default:
+			break;
+	}
+	if (fclose(cf->file))
+		r= -1;
+	g_free(cf->buffer);
+	g_free(cf->plain);
+	if (cf->timer)
+		g_timer_destroy(cf->timer);
+	g_free(cf);
+
+	return r;
+}
+
+gboolean codec_set_level(struct codec_file *cf, int level) {
+	int r;
+
+	if (level == cf->level)
+		return TRUE;
+	switch (cf->type) {
+		case CODEC_GZIP:
+			/* Like gzsetparams(), what was compressed so far is flushed with the old level */
+			do {
+				cf->zs.next_out= (Bytef *)cf->buffer;
+				cf->zs.avail_out= cf->buffer_size;
+				r= deflateParams(&cf->zs, level, Z_DEFAULT_STRATEGY);
+				if (!write_buffer(cf, cf->buffer_size - cf->zs.avail_out))
+					return FALSE;
+			} while (r == Z_BUF_ERROR && cf->zs.avail_out == 0);
+			if (r != Z_OK) {
+				cf->error= "couldn't change the compression level";
+				return FALSE;
+			}
+			break;
+#ifdef WITH_ZSTD
+		case CODEC_ZSTD:
+			/* Only multithreaded compression takes a new level in the middle of a frame */
+			if (cf->frame_open && !zstd_compress(cf, NULL, 0, ZSTD_e_end))
+				return FALSE;
+			r= ZSTD_isError(ZSTD_CCtx_setParameter(cf->cctx, ZSTD_c_compressionLevel, level));
+			if (r) {
+				cf->error= "couldn't change the compression level";
+				return FALSE;
+			}
+			break;
+#endif
+#ifdef WITH_LZ4
+		case CODEC_LZ4:
+			if (cf->frame_open && !lz4_end(cf))
+				return FALSE;
+			break;
+#endif
+		default:
+			break;
+	}
+	cf->level= level;
+	return TRUE;
+}
+
+int codec_get_level(struct codec_file *cf) {
+	return cf->level;
+}
+
+/* Returns the counters and starts them over */
+void codec_take_stats(struct codec_file *cf, struct codec_stats *stats) {
+	*stats= cf->stats;
+	memset(&cf->stats, 0, sizeof(struct codec_stats));
+}
+
+void codec_set_sync(struct codec_file *cf, gsize bytes) {
+	cf->sync_bytes= bytes;
+}
+
+void codec_totals(struct codec_file *cf, guint64 *in_bytes, guint64 *out_bytes) {
+	*in_bytes= cf->total_in;
+	*out_bytes= cf->total_out;
+}
+
+struct codec_block *codec_block_new(enum codec_type type, int level) {
+	struct codec_block *cb= g_new0(struct codec_block, 1);
+
+	cb->type= type;
+	cb->level= resolve_level(type, level);
+	switch (type) {
+		case CODEC_GZIP:
+			/* windowBits 15 + 16 writes a gzip header and trailer around every member */
+			if (deflateInit2(&cb->zs, cb->level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+				g_free(cb);
+				return NULL;
+			}
+			break;
+#ifdef WITH_ZSTD
+		case CODEC_ZSTD:
+			if (!(cb->cctx= ZSTD_createCCtx())) {
+				g_free(cb);
+				return NULL;
+			}
+			ZSTD_CCtx_setParameter(cb->cctx, ZSTD_c_compressionLevel, cb->level);
+			break;
+#endif
+#ifdef WITH_LZ4
+		case CODEC_LZ4:
+			lz4_preferences(&cb->prefs, cb->level);
+			break;
+#endif
+		default:
+			break;
+	}
+	return cb;
+}
+
+gboolean codec_block_compress(struct codec_block *cb, GString *out, const char *data, gsize len, struct codec_dict *dict) {
+#if defined(WITH_ZSTD) || defined(WITH_LZ4)
+	size_t r;
+#endif
+
+	(void) dict;
+	switch (cb->type) {
+		case CODEC_GZIP:
+			deflateReset(&cb->zs);
+			g_string_set_size(out, deflateBound(&cb->zs, len));
+			cb->zs.next_in= (Bytef *)data;
+			cb->zs.avail_in= len;
+			cb->zs.next_out= (Bytef *)out->str;
+			cb->zs.avail_out= out->len;
+			if (deflate(&cb->zs, Z_FINISH) != Z_STREAM_END) {
+				g_critical("Couldn't compress data: %s", cb->zs.msg ? cb->zs.msg : "unknown error");
+				return FALSE;
+			}
+			g_string_set_size(out, cb->zs.total_out);
+			return TRUE;
+#ifdef WITH_ZSTD
+		case CODEC_ZSTD:
+			ZSTD_CCtx_refCDict(cb->cctx, dict ? dict->cdict : NULL);
+			g_string_set_size(out, ZSTD_compressBound(len));
+			r= ZSTD_compress2(cb->cctx, out->str, out->len, data, len);
+			if (ZSTD_isError(r)) {
+				g_critical("Couldn't compress data: %s", ZSTD_getErrorName(r));
+				return FALSE;
+			}
+			g_string_set_size(out, r);
+			return TRUE;
+#endif
+#ifdef WITH_LZ4
+		case CODEC_LZ4:
+			g_string_set_size(out, LZ4F_compressFrameBound(len, &cb->prefs));
+			r= LZ4F_compressFrame(out->str, out->len, data, len, &cb->prefs);
+			if (LZ4F_isError(r)) {
+				g_critical("Couldn't compress data: %s", LZ4F_getErrorName(r));
+				return FALSE;
+			}
+			g_string_set_size(out, r);
+			return TRUE;
+#endif
+		default:
+			g_string_truncate(out, 0);
+			g_string_append_len(out, data, len);
+			return TRUE;
+	}
+}
+
+gboolean codec_block_set_level(struct codec_block *cb, int level) {
+	if (level == cb->level)
+		return TRUE;
+	switch (cb->type) {
+		case CODEC_GZIP:
+			/* Between members there is nothing to flush, the stream just starts over */
+			deflateEnd(&cb->zs);
+			if (deflateInit2(&cb->zs, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+				return FALSE;
+			break;
+#ifdef WITH_ZSTD
+		case CODEC_ZSTD:
+			if (ZSTD_isError(ZSTD_CCtx_setParameter(cb->cctx, ZSTD_c_compressionLevel, level)))
+				return FALSE;
+			break;
+#endif
+#ifdef WITH_LZ4
+		case CODEC_LZ4:
+			cb->prefs.compressionLevel= level;
+			break;
+#endif
+		default:
+			break;
+	}
+	cb->level= level;
+	return TRUE;
+}
+
+void codec_block_free(struct codec_block *cb) {
+	switch (cb->type) {
+		case CODEC_GZIP:
+			deflateEnd(&cb->zs);
+			break;
+#ifdef WITH_ZSTD
+		case CODEC_ZSTD:
+			ZSTD_freeCCtx(cb->cctx);
+			break;
+#endif
+		default:
+			break;
+	}
+	g_free(cb);
+}
+
+struct codec_dict *codec_dict_train(const char *samples, const gsize *sizes, guint count, int level) {
+#ifdef WITH_ZSTD
+	struct codec_dict *dict= g_new0(struct codec_dict, 1);
+	size_t r;
+
+	dict->data= g_malloc(DICT_SIZE);
+	r= ZDICT_trainFromBuffer(dict->data, DICT_SIZE, samples, sizes, count);
+	if (ZDICT_isError(r)) {
+		g_warning("Couldn't train compression dictionary: %s", ZDICT_getErrorName(r));
+		codec_dict_free(dict);
+		return NULL;
+	}
+	dict->size= r;
+	dict->cdict= ZSTD_createCDict(dict->data, dict->size, level >= 0 ? level : ZSTD_CLEVEL_DEFAULT);
+	if (!dict->cdict) {
+		codec_dict_free(dict);
+		return NULL;
+	}
+	return dict;
+#else
+	(void) samples;
+	(void) sizes;
+	(void) count;
+	(void) level;
+	return NULL;
+#endif
+}
+
+gboolean codec_dict_save(struct codec_dict *dict, const char *path) {
+	GError *error= NULL;
+
+	if (!g_file_set_contents(path, dict->data, dict->size, &error)) {
+		g_critical("Couldn't write dictionary %s: %s", path, error->message);
+		g_error_free(error);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+struct codec_dict *codec_dict_load(const char *path) {
+#ifdef WITH_ZSTD
+	struct codec_dict *dict= g_new0(struct codec_dict, 1);
+	GError *error= NULL;
+
+	if (!g_file_get_contents(path, &dict->data, &dict->size, &error)) {
+		g_critical("Couldn't read dictionary %s: %s", path, error->message);
+		g_error_free(error);
+		g_free(dict);
+		return NULL;
+	}
+	if (!(dict->ddict= ZSTD_createDDict(dict->data, dict->size))) {
+		g_critical("Couldn't load dictionary %s", path);
+		codec_dict_free(dict);
+		return NULL;
+	}
+	return dict;
+#else
+	(void) path;
+	return NULL;
+#endif
+}
+
+void codec_dict_free(struct codec_dict *dict) {
+	if (!dict)
+		return;
+#ifdef WITH_ZSTD
+	ZSTD_freeCDict(dict->cdict);
+	ZSTD_freeDDict(dict->ddict);
+#endif
+	g_free(dict->data);
+	g_free(dict);
+}
+
+gchar *codec_dict_filename(const char *filename) {
+	const char *sql= g_strrstr(filename, ".sql");
+	gsize len= sql ? (gsize)(sql - filename) : strlen(filename);
+	gsize digits= 0;
+
+	/* Chunk files share the table's dictionary, drop the chunk number */
+	while (digits < len && g_ascii_isdigit(filename[len - digits - 1]))
+		digits++;
+	if (digits && digits < len && filename[len - digits - 1] == '.')
+		len-= digits + 1;
+
+	return g_strdup_printf("%.*s.zdict", (int)len, filename);
+}
+
+void codec_set_dict(struct codec_file *cf, struct codec_dict *dict) {
+#ifdef WITH_ZSTD
+	if (cf->type != CODEC_ZSTD || !dict)
+		return;
+	cf->dict= dict;
+	if (cf->cctx)
+		ZSTD_CCtx_refCDict(cf->cctx, dict->cdict);
+#else
+	(void) cf;
+	(void) dict;
+#endif
+}
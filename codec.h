@@ -0,0 +1,82 @@
+/* 
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+#ifndef _codec_h
+#define _codec_h
+
+#include <glib.h>
+
+/* Output formats for dump files, CODEC_NONE is plain text */
+enum codec_type { CODEC_NONE, CODEC_GZIP, CODEC_ZSTD, CODEC_LZ4, CODEC_COUNT };
+
+struct codec_file;
+struct codec_block;
+struct codec_dict;
+
+/* What writing a file cost since the stats were last taken */
+struct codec_stats {
+	guint64 in_bytes;
+	guint64 out_bytes;
+	gdouble compress_seconds;
+	gdouble io_seconds;
+};
+
+/* Parses --compress-format, FALSE when unknown or not compiled in */
+gboolean codec_from_name(const char *name, enum codec_type *type);
+const char *codec_extension(enum codec_type type);
+/* The format a file was written in, by its file name */
+enum codec_type codec_for_path(const char *path);
+
+/* Stream files, mode is "r", "w" or "a". level -1 is the format default, threads is only used by zstd */
+struct codec_file *codec_open(const char *path, const char *mode, enum codec_type type, int level, int threads);
+gboolean codec_write(struct codec_file *cf, const char *data, gsize len);
+/* Reads up to len - 1 bytes, stops after a newline, like fgets() */
+char *codec_gets(struct codec_file *cf, char *buf, int len);
+gboolean codec_eof(struct codec_file *cf);
+const char *codec_error(struct codec_file *cf);
+int codec_close(struct codec_file *cf);
+
+/* Levels worth adapting between, from the fastest to the best compression, and the format default */
+void codec_level_range(enum codec_type type, int *fastest, int *start, int *best);
+/* The level that spends the least on data that doesn't compress */
+int codec_store_level(enum codec_type type);
+/* Writing: the level of the data written next, zstd and lz4 start a new frame for it */
+gboolean codec_set_level(struct codec_file *cf, int level);
+int codec_get_level(struct codec_file *cf);
+void codec_take_stats(struct codec_file *cf, struct codec_stats *stats);
+/* Writing: flush to the disk every bytes written, counted in io_seconds. 0, the default, never does */
+void codec_set_sync(struct codec_file *cf, gsize bytes);
+/* Bytes taken in and written out since the file was opened */
+void codec_totals(struct codec_file *cf, guint64 *in_bytes, guint64 *out_bytes);
+
+/* Self contained blocks (a gzip member, a zstd or lz4 frame), concatenated they read back as one stream.
+   dict is only used by zstd and may be NULL */
+struct codec_block *codec_block_new(enum codec_type type, int level);
+gboolean codec_block_compress(struct codec_block *cb, GString *out, const char *data, gsize len, struct codec_dict *dict);
+gboolean codec_block_set_level(struct codec_block *cb, int level);
+void codec_block_free(struct codec_block *cb);
+
+/* zstd dictionaries, trained from count samples stored back to back. Without zstd support these are
+   never created and setting a NULL dictionary does nothing */
+struct codec_dict *codec_dict_train(const char *samples, const gsize *sizes, guint count, int level);
+gboolean codec_dict_save(struct codec_dict *dict, const char *path);
+struct codec_dict *codec_dict_load(const char *path);
+void codec_dict_free(struct codec_dict *dict);
+/* Dictionary file shared by all the chunks of a table: db.table.00001.sql.zst -> db.table.zdict */
+gchar *codec_dict_filename(const char *filename);
+/* Writing: compress with dict, call before the first write. Reading: use dict for files written with it */
+void codec_set_dict(struct codec_file *cf, struct codec_dict *dict);
+
+#endif
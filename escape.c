@@ -0,0 +1,241 @@
+/* 
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <glib.h>
+#include <string.h>
+#include "escape.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_ESCAPE_SIMD
+#include <immintrin.h>
+#endif
+
+/* Characters that need a backslash, 0 means copy as is */
+static char escape_map[256];
+
+static gsize escape_scalar(char *to, const char *from, gsize length);
+static gsize (*escape_kernel)(char *to, const char *from, gsize length)= escape_scalar;
+static const char *kernel_name= "scalar";
+
+static const char hex_digits[16]= { '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'A', 'B', 'C', 'D', 'E', 'F' };
+
+static void hex_scalar(char *to, const char *from, gsize length);
+static void (*hex_kernel)(char *to, const char *from, gsize length)= hex_scalar;
+
+static inline char *escape_char(char *to, unsigned char c) {
+	*to++= '\\';
+	*to++= escape_map[c];
+	return to;
+}
+
+static gsize escape_scalar(char *to, const char *from, gsize length) {
+	char *start= to;
+	const char *end= from + length;
+
+	for (; from < end; from++) {
+		if (escape_map[(unsigned char)*from])
+			to= escape_char(to, *from);
+		else
+			*to++= *from;
+	}
+
+	return to - start;
+}
+
+static void hex_scalar(char *to, const char *from, gsize length) {
+	const unsigned char *p= (const unsigned char *)from;
+	const unsigned char *end= p + length;
+
+	for (; p < end; p++) {
+		*to++= hex_digits[*p >> 4];
+		*to++= hex_digits[*p & 0x0f];
+	}
+}
+
+#ifdef HAVE_ESCAPE_SIMD
+/* Copies a block up to its last special character, escaping every position flagged in mask */
+static inline char *escape_block_mask(char *to, const char *from, guint mask) {
+	guint done= 0;
+
+	while (mask) {
+		guint pos= __builtin_ctz(mask);
+		memcpy(to, from + done, pos - done);
+		to= escape_char(to + (pos - done), from[pos]);
+		done= pos + 1;
+		mask&= mask - 1;
+	}
+
+	return to;
+}
+
+__attribute__((target("sse4.2")))
+static gsize escape_sse42(char *to, const char *from, gsize length) {
+	char *start= to;
+	const char *end= from + length;
+	const __m128i specials= _mm_setr_epi8(0, '\n', '\r', '\\', '\'', '\"', '\032', 0, 0, 0, 0, 0, 0, 0, 0, 0);
+
+	while (end - from >= 16) {
+		__m128i block= _mm_loadu_si128((const __m128i *)from);
+		guint mask= _mm_cvtsi128_si32(_mm_cmpestrm(specials, 7, block, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_BIT_MASK)) & 0xffff;
+
+		if (!mask) {
+			/* Clean span, bulk copy */
+			_mm_storeu_si128((__m128i *)to, block);
+			to+= 16;
+		} else {
+			guint last= 31 - __builtin_clz(mask);
+			to= escape_block_mask(to, from, mask);
+			memcpy(to, from + last + 1, 15 - last);
+			to+= 15 - last;
+		}
+		from+= 16;
+	}
+
+	return (to - start) + escape_scalar(to, from, end - from);
+}
+
+__attribute__((target("avx2")))
+static gsize escape_avx2(char *to, const char *from, gsize length) {
+	char *start= to;
+	const char *end= from + length;
+	const __m256i nul= _mm256_set1_epi8(0);
+	const __m256i nl= _mm256_set1_epi8('\n');
+	const __m256i cr= _mm256_set1_epi8('\r');
+	const __m256i bs= _mm256_set1_epi8('\\');
+	const __m256i sq= _mm256_set1_epi8('\'');
+	const __m256i dq= _mm256_set1_epi8('\"');
+	const __m256i ctrlz= _mm256_set1_epi8('\032');
+
+	while (end - from >= 32) {
+		__m256i block= _mm256_loadu_si256((const __m256i *)from);
+		__m256i hits= _mm256_or_si256(
+			_mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(block, nul), _mm256_cmpeq_epi8(block, nl)),
+					_mm256_or_si256(_mm256_cmpeq_epi8(block, cr), _mm256_cmpeq_epi8(block, bs))),
+			_mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(block, sq), _mm256_cmpeq_epi8(block, dq)),
+					_mm256_cmpeq_epi8(block, ctrlz)));
+		guint mask= (guint)_mm256_movemask_epi8(hits);
+
+		if (!mask) {
+			/* Clean span, bulk copy */
+			_mm256_storeu_si256((__m256i *)to, block);
+			to+= 32;
+		} else {
+			guint last= 31 - __builtin_clz(mask);
+			to= escape_block_mask(to, from, mask);
+			memcpy(to, from + last + 1, 31 - last);
+			to+= 31 - last;
+		}
+		from+= 32;
+	}
+
+	return (to - start) + escape_sse42(to, from, end - from);
+}
+
+/* Both nibbles of every byte are looked up at once with a shuffle, output is always twice the input */
+__attribute__((target("ssse3")))
+static void hex_ssse3(char *to, const char *from, gsize length) {
+	const char *end= from + length;
+	const __m128i digits= _mm_loadu_si128((const __m128i *)hex_digits);
+	const __m128i nibble= _mm_set1_epi8(0x0f);
+
+	while (end - from >= 16) {
+		__m128i block= _mm_loadu_si128((const __m128i *)from);
+		__m128i high= _mm_shuffle_epi8(digits, _mm_and_si128(_mm_srli_epi16(block, 4), nibble));
+		__m128i low= _mm_shuffle_epi8(digits, _mm_and_si128(block, nibble));
+
+		_mm_storeu_si128((__m128i *)to, _mm_unpacklo_epi8(high, low));
+		_mm_storeu_si128((__m128i *)(to + 16), _mm_unpackhi_epi8(high, low));
+		from+= 16;
+		to+= 32;
+	}
+	hex_scalar(to, from, end - from);
+}
+
+__attribute__((target("avx2")))
+static void hex_avx2(char *to, const char *from, gsize length) {
+	const char *end= from + length;
+	const __m256i digits= _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)hex_digits));
+	const __m256i nibble= _mm256_set1_epi8(0x0f);
+
+	while (end - from >= 32) {
+		__m256i block= _mm256_loadu_si256((const __m256i *)from);
+		__m256i high= _mm256_shuffle_epi8(digits, _mm256_and_si256(_mm256_srli_epi16(block, 4), nibble));
+		__m256i low= _mm256_shuffle_epi8(digits, _mm256_and_si256(block, nibble));
+		/* Unpacking works within 128 bit lanes, the halves are put back in order */
+		__m256i first= _mm256_unpacklo_epi8(high, low);
+		__m256i second= _mm256_unpackhi_epi8(high, low);
+
+		_mm256_storeu_si256((__m256i *)to, _mm256_permute2x128_si256(first, second, 0x20));
+		_mm256_storeu_si256((__m256i *)(to + 32), _mm256_permute2x128_si256(first, second, 0x31));
+		from+= 32;
+		to+= 64;
+	}
+	hex_ssse3(to, from, end - from);
+}
+#endif
+
+void init_escape(void) {
+	escape_map[0]= '0';
+	escape_map['\n']= 'n';
+	escape_map['\r']= 'r';
+	escape_map['\\']= '\\';
+	escape_map['\'']= '\'';
+	escape_map['\"']= '\"';
+	escape_map['\032']= 'Z';
+
+#ifdef HAVE_ESCAPE_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		escape_kernel= escape_avx2;
+		kernel_name= "avx2";
+	} else if (__builtin_cpu_supports("sse4.2")) {
+		escape_kernel= escape_sse42;
+		kernel_name= "sse4.2";
+	}
+	if (__builtin_cpu_supports("avx2"))
+		hex_kernel= hex_avx2;
+	else if (__builtin_cpu_supports("ssse3"))
+		hex_kernel= hex_ssse3;
+#endif
+}
+
+const char *escape_kernel_name(void) {
+	return kernel_name;
+}
+
+gsize escape_string(char *to, const char *from, gsize length) {
+	return escape_kernel(to, from, length);
+}
+
+void g_string_append_escaped(GString *string, const char *from, gsize length) {
+	gsize len= string->len;
+
+	/* Grow once for the worst case, then trim to what was really written */
+	g_string_set_size(string, len + length * 2);
+	len+= escape_kernel(string->str + len, from, length);
+	g_string_set_size(string, len);
+}
+
+void hex_string(char *to, const char *from, gsize length) {
+	hex_kernel(to, from, length);
+}
+
+void g_string_append_hex(GString *string, const char *from, gsize length) {
+	gsize len= string->len;
+
+	g_string_set_size(string, len + length * 2);
+	hex_kernel(string->str + len, from, length);
+}
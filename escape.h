@@ -0,0 +1,36 @@
+/* 
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+#ifndef _escape_h
+#define _escape_h
+
+#include <glib.h>
+
+/* Picks the fastest escaping kernel for this CPU, call once before any thread starts */
+void init_escape(void);
+const char *escape_kernel_name(void);
+
+/* Backslash escapes like mysql_real_escape_string() does for the binary character set.
+   to must have room for 2*length bytes, returns the number of bytes written. No NUL is added. */
+gsize escape_string(char *to, const char *from, gsize length);
+
+/* Appends the escaped value to the end of the string without an intermediate buffer */
+void g_string_append_escaped(GString *string, const char *from, gsize length);
+
+/* Writes every byte as two upper case hex digits like HEX() does, to must have room for 2*length bytes */
+void hex_string(char *to, const char *from, gsize length);
+void g_string_append_hex(GString *string, const char *from, gsize length);
+
+#endif
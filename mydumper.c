@@ -30,7 +30,6 @@
 #include <stdarg.h>
 #include <errno.h>
 #include <time.h>
-#include <zlib.h>
 #include <pcre.h>
 #include <signal.h>
 #include <glib/gstdio.h>
@@ -43,6 +42,8 @@
 #include "server_detect.h"
 #include "common.h"
 #include "g_unix_signal.h"
+#include "escape.h"
+#include "codec.h"
 #include <math.h>
 
 char *regexstring=NULL;
@@ -52,6 +53,7 @@ const char DIRECTORY[]= "export";
 const char BINLOG_DIRECTORY[]= "binlog_snapshot";
 const char DAEMON_BINLOGS[]= "binlogs";
 #endif
+const char CHUNK_PLANS[]= "chunk_plans";
 
 static GMutex * init_mutex = NULL;
 
@@ -60,8 +62,20 @@ gchar *output_directory= NULL;
 gchar *output_filename=NULL;
 enum destination_type destination_type;
 GHashTable *output_filename_array=NULL;
+GMutex *output_filename_mutex=NULL;
+/* Key ranges being dumped right now */
+GMutex *key_ranges_mutex=NULL;
+GList *key_ranges=NULL;
+/* Daemon mode: chunk plans of the last snapshot and of the one being dumped */
+GKeyFile *chunk_plans=NULL;
+GKeyFile *next_chunk_plans=NULL;
+GMutex *chunk_plans_mutex=NULL;
 guint statement_size= 1000000;
 guint rows_per_file= 0;
+guint chunk_size= 0;
+guint page_rows= 0;
+guint scan_threads= 0;
+gboolean split_partitions= FALSE;
 guint chunk_filesize = 0;
 int longquery= 60;
 int build_empty_files= 0;
@@ -69,6 +83,17 @@ int skip_tz= 0;
 int need_dummy_read= 0;
 int need_dummy_toku_read = 0;
 int compress_output= 0;
+gchar *compress_format= NULL;
+enum codec_type output_codec= CODEC_NONE;
+int compress_level= -1;
+guint compress_threads= 0;
+gboolean zstd_dictionary= FALSE;
+gboolean adaptive_compression= FALSE;
+guint memory_limit= 0;
+struct memory_budget *budget= NULL;
+struct compress_tuner *tuner= NULL;
+GHashTable *table_dicts= NULL;
+GMutex *table_dicts_mutex= NULL;
 int killqueries= 0;
 int detected_server= 0;
 int lock_all_tables=0;
@@ -102,6 +127,10 @@ gboolean no_dump_views= FALSE;
 gboolean less_locking = FALSE;
 gboolean use_savepoints = FALSE;
 gboolean success_on_1146 = FALSE;
+gboolean binary_protocol = FALSE;
+gboolean hex_blob = FALSE;
+guint writer_threads = 0;
+struct writer_pool *writer_pool= NULL;
 
 GList *innodb_tables= NULL;
 GList *non_innodb_table= NULL;
@@ -135,8 +164,18 @@ static GOptionEntry entries[] =
 	{ "outputfilename", 'f', 0, G_OPTION_ARG_FILENAME, &output_filename, "Filename when you want just one file",  NULL },
 	{ "statement-size", 's', 0, G_OPTION_ARG_INT, &statement_size, "Attempted size of INSERT statement in bytes, default 1000000", NULL},
 	{ "rows", 'r', 0, G_OPTION_ARG_INT, &rows_per_file, "Try to split tables into chunks of this many rows. This option turns off --chunk-filesize", NULL},
+	{ "chunk-size", 0, 0, G_OPTION_ARG_INT, &chunk_size, "Try to split tables into chunks of this much data, using table statistics. This value is in MB and turns off --chunk-filesize", NULL},
+	{ "split-partitions", 0, 0, G_OPTION_ARG_NONE, &split_partitions, "Dump every partition of a partitioned table as a job of its own, instead of splitting it with --rows or --chunk-size", NULL},
+	{ "scan-threads", 0, 0, G_OPTION_ARG_INT, &scan_threads, "Threads writing a big table that is dumped as a single job, it is read in one scan and written to this many files, default 0", NULL},
+	{ "page-rows", 0, 0, G_OPTION_ARG_INT, &page_rows, "Read tables with a primary key in pages of this many rows, one query each, default off", NULL},
 	{ "chunk-filesize", 'F', 0, G_OPTION_ARG_INT, &chunk_filesize, "Split tables into chunks of this output file size. This value is in MB", NULL },
 	{ "compress", 'c', 0, G_OPTION_ARG_NONE, &compress_output, "Compress output files", NULL},
+	{ "compress-format", 0, 0, G_OPTION_ARG_STRING, &compress_format, "Compression format for output files: gzip, zstd or lz4, implies --compress, default gzip", NULL},
+	{ "compress-level", 0, 0, G_OPTION_ARG_INT, &compress_level, "Compression level, default is the format's own default", NULL},
+	{ "compress-threads", 0, 0, G_OPTION_ARG_INT, &compress_threads, "Threads used by zstd to compress each file, default 0", NULL},
+	{ "zstd-dictionary", 0, 0, G_OPTION_ARG_NONE, &zstd_dictionary, "Train a zstd dictionary from the first chunks of each table and compress the remaining chunks with it", NULL},
+	{ "memory-limit", 0, 0, G_OPTION_ARG_INT, &memory_limit, "Memory in MB the statements of all threads may use, big rows wait for it, 0 for no limit", NULL},
+	{ "adaptive-compression", 0, 0, G_OPTION_ARG_NONE, &adaptive_compression, "Adapt the compression level to the speed of the disk and store tables that don't compress, data files are synced every few MB to time the disk", NULL},
 	{ "build-empty-files", 'e', 0, G_OPTION_ARG_NONE, &build_empty_files, "Build dump files even if no data available from table", NULL},
 	{ "regex", 'x', 0, G_OPTION_ARG_STRING, &regexstring, "Regular expression for 'db.table' matching", NULL},
 	{ "ignore-engines", 'i', 0, G_OPTION_ARG_STRING, &ignore_engines, "Comma delimited list of storage engines to ignore", NULL },
@@ -163,6 +202,9 @@ static GOptionEntry entries[] =
 	{ "lock-all-tables", 0, 0, G_OPTION_ARG_NONE, &lock_all_tables, "Use LOCK TABLE for all, instead of FTWRL", NULL},
 	{ "updated-since", 'U', 0, G_OPTION_ARG_INT, &updated_since, "Use Update_time to dump only tables updated in the last U days", NULL},
 	{ "trx-consistency-only", 0, 0, G_OPTION_ARG_NONE, &trx_consistency_only, "Transactional consistency only", NULL},
+	{ "binary-protocol", 0, 0, G_OPTION_ARG_NONE, &binary_protocol, "Fetch table data with prepared statements, integers and dates are read as typed values", NULL},
+	{ "hex-blob", 0, 0, G_OPTION_ARG_NONE, &hex_blob, "Dump binary string and BLOB columns as hex literals", NULL},
+	{ "writer-threads", 0, 0, G_OPTION_ARG_INT, &writer_threads, "Number of threads writing and compressing table data, 0 writes in the dumping threads, default 0", NULL},
 	{ NULL, 0, 0, G_OPTION_ARG_NONE,   NULL, NULL, NULL }
 };
 
@@ -173,22 +215,81 @@ void dump_triggers_data(MYSQL *conn, char *database, char *table, char *filename
 void dump_view_data(MYSQL *conn, char *database, char *table, char *filename, char *filename2);
 void dump_schema(MYSQL *conn, char *database, char *table, struct configuration *conf);
 void dump_view(char *database, char *table, struct configuration *conf);
-void dump_table(MYSQL *conn, char *database, char *table, struct configuration *conf, gboolean is_innodb);
+void dump_table(MYSQL *conn, struct db_table *dbt, struct configuration *conf, gboolean is_innodb);
+void plan_table(MYSQL *conn, struct db_table *dbt, struct configuration *conf);
 void dump_tables(MYSQL *, GList *, struct configuration *);
 void dump_schema_post(char *database, struct configuration *conf);
 void restore_charset(GString* statement);
 void set_charset(GString* statement, char *character_set, char *collation_connection);
 void dump_schema_post_data(MYSQL *conn, char *database, char *filename);
-guint64 dump_table_data(MYSQL *, FILE *, char *, char *, char *, char *);
+guint64 dump_table_data(MYSQL *, FILE *, char *, char *, char *, char *, char *, struct thread_data *, struct key_range_chunk *);
 void dump_database(MYSQL *, char *, FILE *,  struct configuration *);
+void get_all_tables(MYSQL *conn, GList *databases, FILE *file, struct configuration *conf);
+void add_tables(MYSQL *conn, MYSQL_RES *result, char *database, FILE *file, struct configuration *conf);
+void find_schema_post(MYSQL *conn, char *database);
 void dump_create_database(MYSQL *conn, char *database);
 void get_tables(MYSQL * conn,  struct configuration *);
 void get_not_updated(MYSQL *conn);
-GList * get_chunks_for_table(MYSQL *, char *, char*,  struct configuration *conf);
+GList * get_chunks_for_table(MYSQL *, char *, char*,  struct configuration *conf, guint64 rows_per_chunk, GList **ranges);
+GList *get_key_ranges(char *field, GList *boundaries, char *min, char *max, guint64 rows_per_chunk);
+struct key_range_chunk *new_key_range(char *field, gint64 from, gint64 to, guint64 rows);
+gchar *take_key_slice(struct key_range_chunk *kr);
+struct key_range_chunk *steal_key_range(void);
+void register_key_range(struct key_range_chunk *kr);
+void finish_key_range(struct key_range_chunk *kr);
+guint64 chunk_rows(struct db_table *dbt);
+GList *get_key_boundaries(MYSQL *conn, char *database, char *table, const char *index, char *columns, const char *null_column, guint64 rows_per_chunk);
+GList *get_key_chunks(char *columns, GList *boundaries, const char *null_column);
+GList *get_range_boundaries(MYSQL *conn, char *database, char *table, char *field, char *min, char *max, guint64 rows, guint64 rows_per_chunk, gboolean *reliable);
+guint64 estimate_range(MYSQL *conn, char *database, char *table, char *field, gint64 from, gint64 to);
+static gboolean is_binary_field(MYSQL_FIELD *field);
+static gboolean is_exact_key_field(MYSQL_FIELD *field);
+void set_table_stats(struct db_table *dbt, MYSQL_ROW row, int rcol, int acol, int dcol, int tcol);
 guint64 estimate_count(MYSQL *conn, char *database, char *table, char *field, char *from, char *to);
-void dump_table_data_file(MYSQL *conn, char *database, char *table, char *where, char *filename);
+void dump_table_data_file(MYSQL *conn, char *database, char *table, char *where, char *partition, char *filename, struct thread_data *td, struct key_range_chunk *range, guint chunk);
+guint scan_files_for_table(struct db_table *dbt);
+void start_chunk_plans(void);
+void finish_chunk_plans(void);
+GList *get_planned_chunks(MYSQL *conn, struct db_table *dbt, struct configuration *conf, GList **ranges);
+void remember_chunk_run(char *database, char *table, guint chunk, guint64 rows, gdouble seconds);
+guint64 dump_table_scan(MYSQL *conn, char *database, char *table, char *prefix, guint scan_files, struct thread_data *td);
+void *scan_encoder_thread(struct scan_encoder *se);
+GList *get_partitions(MYSQL *conn, char *database, char *table);
+void free_stmt_buffers(struct stmt_buffers *sb);
+void prepare_row_encoder(struct row_encoder *re, MYSQL_FIELD *fields, guint num_fields, struct stmt_buffers *sb);
+void free_row_encoder(struct row_encoder *re);
+void encode_row(struct row_encoder *re, GString *statement, MYSQL_ROW row, gulong *lengths, struct stmt_buffers *sb, MYSQL_FIELD *fields);
 void create_backup_dir(char *directory);
 gboolean write_data(FILE *,GString*);
+gboolean write_data_prefix(FILE *,GString*, gsize);
+void append_data_header(GString *);
+GString *flush_statement(struct thread_data *td, void *file, gsize flushed, GString *prefix);
+void queue_write(void *file, GString *data, guint64 reserved);
+void *open_data_file(char *filename);
+void *open_data_file_async(char *filename);
+guint64 data_file_size(void *file, guint64 flushed, gsize pending);
+void close_data_file(void *file, gboolean wait);
+void start_writers(void);
+void stop_writers(void);
+struct table_dict *get_table_dict(char *filename);
+void set_table_dict_jobs(char *filename, guint jobs);
+void free_table_dict(struct table_dict *d);
+void add_dict_samples(struct table_dict *d, const char *data, gsize len);
+void table_dict_chunk_done(struct table_dict *d, gboolean last);
+void set_data_file_dict(void *file, struct table_dict *d);
+void start_compress_tuner(void);
+void tune_compression(struct codec_stats *stats);
+int compress_tuner_level(void);
+void adapt_file_level(struct codec_file *cf);
+gboolean incompressible(const char *data, gsize len);
+void set_data_file_store(void *file);
+void start_memory_budget(guint64 baseline);
+void memory_account(gint64 bytes);
+gboolean memory_exceeded(guint64 bytes);
+void memory_reserve(struct thread_data *td, guint64 *held, guint64 bytes);
+void memory_release(guint64 bytes);
+void reserve_statement_growth(struct thread_data *td, GString *statement, gulong *lengths, guint num_fields);
+GString *release_row_memory(struct thread_data *td, MYSQL_STMT *stmt, struct stmt_buffers *sb, guint num_fields);
 gboolean real_write_data(FILE* file,GString * data);
 gboolean check_regex(char *database, char *table);
 void no_log(const gchar *log_domain, GLogLevelFlags log_level, const gchar *message, gpointer user_data);
@@ -202,6 +303,15 @@ MYSQL *create_main_connection();
 void *exec_thread(void *data);
 void write_log_file(const gchar *log_domain, GLogLevelFlags log_level, const gchar *message, gpointer user_data);
 gboolean close_sync_data_statement(FILE* file);
+gboolean open_data_result(MYSQL *conn, char *database, char *table, const char *partition, const char *where, const char *order, struct thread_data *td, MYSQL_STMT **stmtp, MYSQL_RES **resultp);
+gchar **get_primary_key(MYSQL *conn, char *database, char *table);
+gboolean start_data_source(MYSQL *conn, char *database, char *table, struct data_source *src, struct thread_data *td, MYSQL_STMT **stmt, MYSQL_RES **result);
+gboolean open_data_source(MYSQL *conn, char *database, char *table, struct data_source *src, struct thread_data *td, MYSQL_STMT **stmt, MYSQL_RES **result);
+gboolean next_data_result(MYSQL *conn, char *database, char *table, struct data_source *src, struct thread_data *td, MYSQL_STMT **stmt, MYSQL_RES **result, MYSQL_FIELD **fields);
+void remember_page_key(MYSQL *conn, struct data_source *src, MYSQL_ROW row, gulong *lengths, struct stmt_buffers *sb, MYSQL_FIELD *fields);
+void free_data_source(struct data_source *src);
+gboolean copy_spill_file(struct sync_data *sd, struct codec_file *outfile);
+gboolean spill_sync_data(struct sync_data *sd, FILE *file);
 void enqueue_triggers_job(char *database, char *table, struct configuration *conf);
 
 
@@ -209,22 +319,20 @@ int close_file(void * outfile){
 	if (destination_type==STDOUT)
 		return 0;
 	if (output_filename==NULL){	
-		if (!compress_output){
-			return fclose((FILE *)outfile);
-		} else {
-			return gzclose((gzFile)outfile);
-		}
+		return codec_close((struct codec_file *)outfile);
 	}else{
 		return close_sync_data_statement((FILE *)outfile);
 	}
 }
+/* With --adaptive-compression data files are synced every this many bytes, so writing is timed on the disk */
+#define TUNE_SYNC_BYTES (8 * 1024 * 1024)
+
 void * open_file(char * filename){
 	void * outfile=NULL;
 	if (output_filename==NULL){
-		if (!compress_output)
-			outfile= g_fopen(filename, "w");
-		else
-			outfile= (void*) gzopen(filename, "w");
+		outfile= codec_open(filename, "w", output_codec, tuner ? compress_tuner_level() : compress_level, compress_threads);
+		if (outfile && tuner)
+			codec_set_sync((struct codec_file *)outfile, TUNE_SYNC_BYTES);
 	}else{
 		outfile=(void *)(gint64)g_str_hash(filename);
 	}
@@ -492,6 +600,9 @@ void *process_queue(struct thread_data *td) {
 	struct schema_job* sj= NULL;
 	struct view_job* vj= NULL;
 	struct schema_post_job* sp= NULL;
+	struct key_range_chunk* range= NULL;
+	struct db_table* dbt= NULL;
+	struct discovery_job* dj= NULL;
 	#ifdef WITH_BINLOG
 	struct binlog_job* bj= NULL;
 	#endif
@@ -512,28 +623,72 @@ void *process_queue(struct thread_data *td) {
 		GTimeVal tv;
 		g_get_current_time(&tv);
 		g_time_val_add(&tv,1000*1000*1);
-		job=(struct job *)g_async_queue_pop(conf->queue);
-		if (shutdown_triggered && (job->type != JOB_SHUTDOWN)) {
+		job=(struct job *)g_async_queue_try_pop(conf->queue);
+		/* Nothing queued, take over half of whatever range is furthest from done before waiting for more */
+		if (!job && !shutdown_triggered && (range= steal_key_range())) {
+			g_message("Thread %d dumping data for `%s`.`%s` taken over from another thread into %s", td->thread_id, range->database, range->table, range->filename);
+			dump_table_data_file(thrconn, range->database, range->table, NULL, NULL, range->filename, td, range, 0);
+			continue;
+		}
+		/* Ranges other threads start meanwhile are looked at again after a second */
+		if (!job && !(job=(struct job *)g_async_queue_timed_pop(conf->queue, &tv)))
+			continue;
+		/* The main thread waits for what discovery jobs found */
+		if (shutdown_triggered && (job->type != JOB_SHUTDOWN) && (job->type != JOB_DISCOVER)) {
 			continue;
 		}
 
 		switch (job->type) {
+			case JOB_DISCOVER:
+				dj=(struct discovery_job *)job->job_data;
+				/* A stored result doesn't need the connection, the main thread reads it while this one goes on */
+				if (!shutdown_triggered && (mysql_query(thrconn, dj->query) || !(dj->result= mysql_store_result(thrconn)))) {
+					g_critical("Could not list tables: %s", mysql_error(thrconn));
+					errors++;
+				}
+				g_async_queue_push(dj->done, dj);
+				g_free(job);
+				break;
+			case JOB_PLAN:
+				dbt=(struct db_table *)job->job_data;
+				g_message("Thread %d planning data jobs for `%s`.`%s`", td->thread_id, dbt->database, dbt->table);
+				if(use_savepoints && mysql_query(thrconn, "SAVEPOINT mydumper")){
+					g_critical("Savepoint failed: %s",mysql_error(thrconn));
+				}
+				dump_table(thrconn, dbt, conf, TRUE);
+				if(use_savepoints && mysql_query(thrconn, "ROLLBACK TO SAVEPOINT mydumper")){
+					g_critical("Rollback to savepoint failed: %s",mysql_error(thrconn));
+				}
+				g_free(dbt->database);
+				g_free(dbt->table);
+				g_free(dbt->create_time);
+				g_free(dbt);
+				g_free(job);
+				break;
 			case JOB_DUMP:
 				tj=(struct table_job *)job->job_data;
 				if (tj->where)
 					g_message("Thread %d dumping data for `%s`.`%s` where %s", td->thread_id, tj->database, tj->table, tj->where);
+				else if (tj->partition)
+					g_message("Thread %d dumping data for `%s`.`%s` partition %s", td->thread_id, tj->database, tj->table, tj->partition);
+				else if (tj->scan_files)
+					g_message("Thread %d dumping data for `%s`.`%s` into %u files", td->thread_id, tj->database, tj->table, tj->scan_files);
 				else
 					g_message("Thread %d dumping data for `%s`.`%s`", td->thread_id, tj->database, tj->table);
 				if(use_savepoints && mysql_query(thrconn, "SAVEPOINT mydumper")){
 					g_critical("Savepoint failed: %s",mysql_error(thrconn));
 				}
-				dump_table_data_file(thrconn, tj->database, tj->table, tj->where, tj->filename);
+				if (tj->scan_files)
+					dump_table_scan(thrconn, tj->database, tj->table, tj->filename, tj->scan_files, td);
+				else
+					dump_table_data_file(thrconn, tj->database, tj->table, tj->where, tj->partition, tj->filename, td, tj->range, tj->chunk);
 				if(use_savepoints && mysql_query(thrconn, "ROLLBACK TO SAVEPOINT mydumper")){
 					g_critical("Rollback to savepoint failed: %s",mysql_error(thrconn));
 				}
 				if(tj->database) g_free(tj->database);
 				if(tj->table) g_free(tj->table);
 				if(tj->where) g_free(tj->where);
+				if(tj->partition) g_free(tj->partition);
 				if(tj->filename) g_free(tj->filename);
 				g_free(tj);
 				g_free(job);
@@ -542,18 +697,26 @@ void *process_queue(struct thread_data *td) {
 				tj=(struct table_job *)job->job_data;
 				if (tj->where)
 					g_message("Thread %d dumping data for `%s`.`%s` where %s", td->thread_id, tj->database, tj->table, tj->where);
+				else if (tj->partition)
+					g_message("Thread %d dumping data for `%s`.`%s` partition %s", td->thread_id, tj->database, tj->table, tj->partition);
+				else if (tj->scan_files)
+					g_message("Thread %d dumping data for `%s`.`%s` into %u files", td->thread_id, tj->database, tj->table, tj->scan_files);
 				else
 					g_message("Thread %d dumping data for `%s`.`%s`", td->thread_id, tj->database, tj->table);
 				if(use_savepoints && mysql_query(thrconn, "SAVEPOINT mydumper")){
 					g_critical("Savepoint failed: %s",mysql_error(thrconn));
 				}
-				dump_table_data_file(thrconn, tj->database, tj->table, tj->where, tj->filename);
+				if (tj->scan_files)
+					dump_table_scan(thrconn, tj->database, tj->table, tj->filename, tj->scan_files, td);
+				else
+					dump_table_data_file(thrconn, tj->database, tj->table, tj->where, tj->partition, tj->filename, td, tj->range, tj->chunk);
 				if(use_savepoints && mysql_query(thrconn, "ROLLBACK TO SAVEPOINT mydumper")){
 					g_critical("Rollback to savepoint failed: %s",mysql_error(thrconn));
 				}
 				if(tj->database) g_free(tj->database);
 				if(tj->table) g_free(tj->table);
 				if(tj->where) g_free(tj->where);
+				if(tj->partition) g_free(tj->partition);
 				if(tj->filename) g_free(tj->filename);
 				g_free(tj);
 				g_free(job);
@@ -618,6 +781,10 @@ void *process_queue(struct thread_data *td) {
 				g_message("Thread %d shutting down", td->thread_id);
 				if (thrconn)
 					mysql_close(thrconn);
+				free_stmt_buffers(&td->stmt_buffers);
+				free_row_encoder(&td->row_encoder);
+				if (td->statement)
+					g_string_free(td->statement, TRUE);
 				g_free(job);
 				mysql_thread_end();
 				return NULL;
@@ -717,9 +884,14 @@ void *process_queue_less_locking(struct thread_data *td) {
 					tj = (struct table_job *)mj->table_job_list->data;
 					if (tj->where)
 						g_message("Thread %d dumping data for `%s`.`%s` where %s", td->thread_id, tj->database, tj->table, tj->where);
+					else if (tj->scan_files)
+						g_message("Thread %d dumping data for `%s`.`%s` into %u files", td->thread_id, tj->database, tj->table, tj->scan_files);
 					else
 						g_message("Thread %d dumping data for `%s`.`%s`", td->thread_id, tj->database, tj->table);
-					dump_table_data_file(thrconn, tj->database, tj->table, tj->where, tj->filename);
+					if (tj->scan_files)
+						dump_table_scan(thrconn, tj->database, tj->table, tj->filename, tj->scan_files, td);
+					else
+						dump_table_data_file(thrconn, tj->database, tj->table, tj->where, tj->partition, tj->filename, td, tj->range, tj->chunk);
 					if(tj->database) g_free(tj->database);
 					if(tj->table) g_free(tj->table);
 					if(tj->where) g_free(tj->where);
@@ -792,6 +964,10 @@ void *process_queue_less_locking(struct thread_data *td) {
 				g_mutex_unlock(ll_mutex);
 				if (thrconn)
 					mysql_close(thrconn);
+				free_stmt_buffers(&td->stmt_buffers);
+				free_row_encoder(&td->row_encoder);
+				if (td->statement)
+					g_string_free(td->statement, TRUE);
 				g_free(job);
 				mysql_thread_end();
 				return NULL;
@@ -839,6 +1015,8 @@ int main(int argc, char *argv[])
 
 	init_mutex = g_mutex_new();
 	ll_mutex = g_mutex_new();
+	table_dicts_mutex = g_mutex_new();
+	key_ranges_mutex = g_mutex_new();
 	ll_cond = g_cond_new();
 
 	context = g_option_context_new("multi-threaded MySQL dumping");
@@ -858,6 +1036,23 @@ int main(int argc, char *argv[])
 	}
 
 	set_verbose(verbose);
+	init_escape();
+
+	if (compress_format) {
+		if (!codec_from_name(compress_format, &output_codec))
+			exit(EXIT_FAILURE);
+		compress_output= output_codec != CODEC_NONE;
+	} else if (compress_output) {
+		output_codec= CODEC_GZIP;
+	}
+	if (zstd_dictionary && (output_codec != CODEC_ZSTD || output_filename || (!rows_per_file && !chunk_size && !chunk_filesize))) {
+		g_warning("--zstd-dictionary needs --compress-format zstd, --rows, --chunk-size or --chunk-filesize and output to a directory, disabled");
+		zstd_dictionary= FALSE;
+	}
+	if (adaptive_compression && (!compress_output || output_filename)) {
+		g_warning("--adaptive-compression needs compressed output to a directory, disabled");
+		adaptive_compression= FALSE;
+	}
 
 	time_t t;
 	time(&t);localtime_r(&t,&tval);
@@ -867,6 +1062,22 @@ int main(int argc, char *argv[])
 		chunk_filesize = 0;
 		g_warning("--chunk-filesize disabled by --rows option");
 	}
+	if (rows_per_file > 0 && chunk_size > 0) {
+		chunk_size= 0;
+		g_warning("--chunk-size disabled by --rows option");
+	}
+	if (chunk_size > 0 && chunk_filesize > 0) {
+		chunk_filesize= 0;
+		g_warning("--chunk-filesize disabled by --chunk-size option");
+	}
+	if (split_partitions && chunk_filesize > 0) {
+		chunk_filesize= 0;
+		g_warning("--chunk-filesize disabled by --split-partitions option");
+	}
+	if (scan_threads > 1 && chunk_filesize > 0) {
+		chunk_filesize= 0;
+		g_warning("--chunk-filesize disabled by --scan-threads option");
+	}
 	
 	//until we have an unique option on lock types we need to ensure this
 	if(no_locks || trx_consistency_only)
@@ -874,9 +1085,9 @@ int main(int argc, char *argv[])
 	
 	/* savepoints workaround to avoid metadata locking issues 
 	   doesnt work for chuncks */
-	if(rows_per_file && use_savepoints){
+	if((rows_per_file || chunk_size) && use_savepoints){
 		use_savepoints = FALSE;
-		g_warning("--use-savepoints disabled by --rows");
+		g_warning("--use-savepoints disabled by %s", rows_per_file ? "--rows" : "--chunk-size");
 	}
 	
 	//clarify binlog coordinates with trx_consistency_only
@@ -890,6 +1101,7 @@ int main(int argc, char *argv[])
 			exit(1);
 		}			
 		output_filename_array=g_hash_table_new(NULL,NULL);
+		output_filename_mutex=g_mutex_new();
 		//TODO Dirname of the output_filename
 		output_directory=g_strdup_printf(".");
 		destination_type = SPEC_FILE;
@@ -1343,7 +1555,19 @@ void start_dump(MYSQL *conn)
 	}
 	
 	GThread **threads = g_new(GThread*,num_threads*(less_locking+1));
-	struct thread_data *td= g_new(struct thread_data, num_threads*(less_locking+1));
+	struct thread_data *td= g_new0(struct thread_data, num_threads*(less_locking+1));
+
+	if (adaptive_compression && destination_type!=STDOUT)
+		start_compress_tuner();
+	/* Writers get the statements of the -o directory output, single file and stdout are written in place */
+	if (writer_threads && output_filename==NULL && destination_type!=STDOUT)
+		start_writers();
+	if (daemon_mode)
+		start_chunk_plans();
+	if (memory_limit)
+		start_memory_budget(((guint64)num_threads*(less_locking+1) + (writer_pool ? writer_pool->num_buffers : 0)) * 2 * statement_size);
+	if (zstd_dictionary && destination_type!=STDOUT)
+		table_dicts= g_hash_table_new_full(g_str_hash, g_str_equal, NULL, (GDestroyNotify)free_table_dict);
 	
 	if(less_locking){
 		conf.queue_less_locking = g_async_queue_new();
@@ -1385,6 +1609,7 @@ void start_dump(MYSQL *conn)
 	} else {
 		MYSQL_RES *databases;
 		MYSQL_ROW row;
+		GList *names= NULL, *iter;
 		if(mysql_query(conn,"SHOW DATABASES") || !(databases = mysql_store_result(conn))) {
 			g_critical("Unable to list databases: %s",mysql_error(conn));
 			exit(EXIT_FAILURE);
@@ -1393,14 +1618,25 @@ void start_dump(MYSQL *conn)
 		while ((row=mysql_fetch_row(databases))) {
 			if (!strcasecmp(row[0],"information_schema") || !strcasecmp(row[0], "performance_schema") || (!strcasecmp(row[0], "data_dictionary")))
 				continue;
-			dump_database(conn, row[0], nufile, &conf);
-			/* Checks PCRE expressions on 'database' string */
-			if (!no_schemas && (regexstring == NULL || check_regex(row[0],NULL)))
-				dump_create_database(conn, row[0]);
-
+			names= g_list_append(names, g_strdup(row[0]));
 		}
 		mysql_free_result(databases);
 
+		/* MySQL lists the tables of all databases at once instead of one SHOW TABLE STATUS each */
+		if (detected_server == SERVER_TYPE_MYSQL)
+			get_all_tables(conn, names, nufile, &conf);
+		for (iter= names; iter; iter= g_list_next(iter)) {
+			if (detected_server == SERVER_TYPE_MYSQL)
+				find_schema_post(conn, (char *)iter->data);
+			else
+				dump_database(conn, (char *)iter->data, nufile, &conf);
+			/* Checks PCRE expressions on 'database' string */
+			if (!no_schemas && (regexstring == NULL || check_regex((char *)iter->data,NULL)))
+				dump_create_database(conn, (char *)iter->data);
+			g_free(iter->data);
+		}
+		g_list_free(names);
+
 	}
 	
 	if (!non_innodb_table){
@@ -1450,7 +1686,7 @@ void start_dump(MYSQL *conn)
 	}else{
 		for (non_innodb_table= g_list_first(non_innodb_table); non_innodb_table; non_innodb_table= g_list_next(non_innodb_table)) {
 			dbt= (struct db_table*) non_innodb_table->data;
-			dump_table(conn, dbt->database, dbt->table, &conf, FALSE);
+			dump_table(conn, dbt, &conf, FALSE);
 			g_atomic_int_inc(&non_innodb_table_counter);
 		}
 		g_list_free(g_list_first(non_innodb_table));
@@ -1459,7 +1695,7 @@ void start_dump(MYSQL *conn)
 	
 	for (innodb_tables= g_list_first(innodb_tables); innodb_tables; innodb_tables= g_list_next(innodb_tables)) {
 		dbt= (struct db_table*) innodb_tables->data;
-		dump_table(conn, dbt->database, dbt->table, &conf, TRUE);
+		plan_table(conn, dbt, &conf);
 	}
 	g_list_free(g_list_first(innodb_tables));
 
@@ -1467,6 +1703,7 @@ void start_dump(MYSQL *conn)
 		dbt= (struct db_table*) table_schemas->data;
 		g_free(dbt->table);
 		g_free(dbt->database);
+		g_free(dbt->create_time);
 		g_free(dbt);
 	}
 	g_list_free(g_list_first(table_schemas));
@@ -1477,6 +1714,7 @@ void start_dump(MYSQL *conn)
 		dump_view(dbt->database, dbt->table, &conf);
 		g_free(dbt->table);
 		g_free(dbt->database);
+		g_free(dbt->create_time);
 		g_free(dbt);
 	}
 	g_list_free(g_list_first(view_schemas));
@@ -1533,6 +1771,27 @@ void start_dump(MYSQL *conn)
 	}
 	g_async_queue_unref(conf.queue);
 
+	if (writer_pool)
+		stop_writers();
+	if (next_chunk_plans)
+		finish_chunk_plans();
+	if (table_dicts) {
+		g_hash_table_destroy(table_dicts);
+		table_dicts= NULL;
+	}
+	if (tuner) {
+		g_mutex_free(tuner->mutex);
+		g_free(tuner);
+		tuner= NULL;
+	}
+	if (budget) {
+		g_message("Statements used at most %" G_GUINT64_FORMAT " MB of memory", budget->peak / 1024 / 1024);
+		g_mutex_free(budget->mutex);
+		g_cond_free(budget->cond);
+		g_free(budget);
+		budget= NULL;
+	}
+
 	time(&t);localtime_r(&t,&tval);
 	fprintf(mdfile,"Finished dump at: %04d-%02d-%02d %02d:%02d:%02d\n",
 		tval.tm_year+1900, tval.tm_mon+1, tval.tm_mday,
@@ -1559,9 +1818,9 @@ void dump_create_database(MYSQL *conn, char *database){
 	MYSQL_ROW row;
 
 	if (daemon_mode)
-		filename = g_strdup_printf("%s/%d/%s-schema-create.sql%s", output_directory, dump_number, database, (compress_output?".gz":""));
+		filename = g_strdup_printf("%s/%d/%s-schema-create.sql%s", output_directory, dump_number, database, codec_extension(output_codec));
 	else
-		filename = g_strdup_printf("%s/%s-schema-create.sql%s", output_directory, database, (compress_output?".gz":""));
+		filename = g_strdup_printf("%s/%s-schema-create.sql%s", output_directory, database, codec_extension(output_codec));
 
 	if (destination_type != STDOUT){
 		outfile=open_file(filename);
@@ -1623,13 +1882,289 @@ void get_not_updated(MYSQL *conn){
 /* Heuristic chunks building - based on estimates, produces list of ranges for datadumping
    WORK IN PROGRESS
 */
-GList * get_chunks_for_table(MYSQL *conn, char *database, char *table, struct configuration *conf) {
+/* A composite key is split on its first column only when that gives this many values per chunk */
+#define COMPOSITE_KEY_MIN_VALUES 4
+
+/* Rows that make up a chunk, --chunk-size turns the table's average row length into a row count */
+guint64 chunk_rows(struct db_table *dbt) {
+	guint64 avg_row_length= dbt->avg_row_length;
+
+	if (!chunk_size)
+		return rows_per_file;
+	if (!avg_row_length && dbt->rows)
+		avg_row_length= dbt->datalength / dbt->rows;
+	/* Without statistics there is nothing to plan with */
+	if (!avg_row_length)
+		return 0;
+	return MAX((guint64)chunk_size*1024*1024 / avg_row_length, 1);
+}
+
+/* Tables with less data than this are written by one thread even with --scan-threads */
+#define SCAN_MIN_DATA_LENGTH (64*1024*1024)
+
+/* Files a table that is dumped as a single job is written to, 0 when one thread writes it */
+guint scan_files_for_table(struct db_table *dbt) {
+	if (scan_threads < 2 || output_filename || destination_type==STDOUT)
+		return 0;
+	if (dbt->datalength < SCAN_MIN_DATA_LENGTH)
+		return 0;
+	return scan_threads;
+}
+
+/* A plan is made again once the table's row count moved by more than this part of it */
+#define PLAN_MAX_DRIFT 0.2
+
+/* Or when a chunk had this many times the rows of the average chunk, or took this many times as long */
+#define PLAN_MAX_SKEW 4
+
+/* The daemon reads the plans of its last run once, after that every snapshot hands them to the next one */
+void start_chunk_plans(void) {
+	gchar *filename;
+	GError *error= NULL;
+
+	if (!chunk_plans_mutex)
+		chunk_plans_mutex= g_mutex_new();
+	if (!chunk_plans) {
+		chunk_plans= g_key_file_new();
+		filename= g_strdup_printf("%s/%s", output_directory, CHUNK_PLANS);
+		if (!g_key_file_load_from_file(chunk_plans, filename, G_KEY_FILE_NONE, &error)) {
+			if (!g_error_matches(error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+				g_warning("Could not read chunk plans from %s, planning every table: %s", filename, error->message);
+			g_error_free(error);
+			g_key_file_free(chunk_plans);
+			chunk_plans= g_key_file_new();
+		}
+		g_free(filename);
+	}
+	next_chunk_plans= g_key_file_new();
+}
+
+/* Saves the plans of a snapshot, an interrupted one didn't plan every table and the last complete one is kept */
+void finish_chunk_plans(void) {
+	gchar *filename, *data;
+	gsize len;
+	GError *error= NULL;
+
+	if (shutdown_triggered) {
+		g_key_file_free(next_chunk_plans);
+		next_chunk_plans= NULL;
+		return;
+	}
+	filename= g_strdup_printf("%s/%s", output_directory, CHUNK_PLANS);
+	data= g_key_file_to_data(next_chunk_plans, &len, NULL);
+	if (!g_file_set_contents(filename, data, len, &error)) {
+		g_warning("Could not save chunk plans to %s: %s", filename, error->message);
+		g_error_free(error);
+	}
+	g_free(data);
+	g_free(filename);
+	g_key_file_free(chunk_plans);
+	chunk_plans= next_chunk_plans;
+	next_chunk_plans= NULL;
+}
+
+/* Group of a table's plan, NULL for names a key file can't have as group */
+static gchar *plan_group(char *database, char *table) {
+	if (strpbrk(database, "[]\r\n") || strpbrk(table, "[]\r\n"))
+		return NULL;
+	return g_strdup_printf("`%s`.`%s`", database, table);
+}
+
+/* Whether the previous snapshot's plan still fits the table, called with chunk_plans_mutex held */
+static gboolean plan_is_current(gchar *group, struct db_table *dbt, guint64 rows_per_chunk, gboolean innodb) {
+	gchar *create_time;
+	gdouble *rows, *seconds;
+	gsize n_rows= 0, n_seconds= 0, i;
+	gdouble total_rows= 0, total_seconds= 0;
+	guint64 planned;
+	gboolean current;
+
+	if (!g_key_file_has_group(chunk_plans, group))
+		return FALSE;
+	if (g_key_file_get_uint64(chunk_plans, group, "rows_per_chunk", NULL) != rows_per_chunk || g_key_file_get_boolean(chunk_plans, group, "innodb", NULL) != innodb)
+		return FALSE;
+	/* A rebuilt table may not have the key it was split on */
+	create_time= g_key_file_get_string(chunk_plans, group, "create_time", NULL);
+	current= !g_strcmp0(create_time, dbt->create_time);
+	g_free(create_time);
+	if (!current)
+		return FALSE;
+	planned= g_key_file_get_uint64(chunk_plans, group, "rows", NULL);
+	if ((gdouble)(MAX(planned, dbt->rows) - MIN(planned, dbt->rows)) > PLAN_MAX_DRIFT * MAX(planned, rows_per_chunk))
+		return FALSE;
+
+	rows= g_key_file_get_double_list(chunk_plans, group, "chunk_rows", &n_rows, NULL);
+	seconds= g_key_file_get_double_list(chunk_plans, group, "chunk_seconds", &n_seconds, NULL);
+	for (i= 0; i < n_rows; i++)
+		total_rows+= rows[i];
+	for (i= 0; i < n_seconds; i++)
+		total_seconds+= seconds[i];
+	for (i= 0; current && i < n_rows; i++)
+		current= rows[i] <= PLAN_MAX_SKEW * total_rows / n_rows;
+	/* Chunks that take a second or less are never worth planning again */
+	for (i= 0; current && i < n_seconds; i++)
+		current= seconds[i] <= MAX(PLAN_MAX_SKEW * total_seconds / n_seconds, 1);
+	g_free(rows);
+	g_free(seconds);
+	return current;
+}
+
+/* Chunks of a plan and its integer key ranges, sized by the rows their chunks had last time */
+static GList *get_plan_chunks(GKeyFile *plans, gchar *group, GList **ranges) {
+	GList *chunks= NULL;
+	gchar **list, **bounds, *field;
+	gdouble *rows;
+	gsize n_chunks= 0, n_bounds= 0, n_rows= 0, i;
+	guint64 rows_per_chunk= g_key_file_get_uint64(plans, group, "rows_per_chunk", NULL);
+	struct key_range_chunk *kr;
+
+	list= g_key_file_get_string_list(plans, group, "chunks", &n_chunks, NULL);
+	for (i= 0; i < n_chunks; i++)
+		chunks= g_list_append(chunks, g_strdup(list[i]));
+	g_strfreev(list);
+
+	field= g_key_file_get_string(plans, group, "range_field", NULL);
+	if (ranges && field) {
+		bounds= g_key_file_get_string_list(plans, group, "range_bounds", &n_bounds, NULL);
+		rows= g_key_file_get_double_list(plans, group, "chunk_rows", &n_rows, NULL);
+		for (i= 0; n_bounds == n_chunks + 1 && i + 1 < n_bounds; i++) {
+			kr= new_key_range(field, g_ascii_strtoll(bounds[i], NULL, 10), g_ascii_strtoll(bounds[i+1], NULL, 10), (i < n_rows && rows[i] > 0) ? (guint64)rows[i] : rows_per_chunk);
+			kr->first= !i;
+			kr->last= i + 2 == n_bounds;
+			*ranges= g_list_append(*ranges, kr);
+		}
+		g_strfreev(bounds);
+		g_free(rows);
+	}
+	g_free(field);
+	return chunks;
+}
+
+/* Keeps a new plan for the next snapshot, chunks on keys that aren't valid UTF-8 are planned every time */
+static void set_plan(gchar *group, struct db_table *dbt, guint64 rows_per_chunk, gboolean innodb, GList *chunks, GList *ranges) {
+	guint n= g_list_length(chunks), i= 0;
+	const gchar **list= g_new0(const gchar *, n + 1);
+	gchar **bounds;
+	gdouble *zeros;
+	GList *iter;
+	struct key_range_chunk *kr= NULL;
+
+	for (iter= chunks; iter; iter= g_list_next(iter)) {
+		if (!g_utf8_validate((gchar *)iter->data, -1, NULL)) {
+			g_free(list);
+			return;
+		}
+		list[i++]= (gchar *)iter->data;
+	}
+	g_key_file_set_uint64(next_chunk_plans, group, "rows", dbt->rows);
+	g_key_file_set_uint64(next_chunk_plans, group, "rows_per_chunk", rows_per_chunk);
+	g_key_file_set_boolean(next_chunk_plans, group, "innodb", innodb);
+	if (dbt->create_time)
+		g_key_file_set_string(next_chunk_plans, group, "create_time", dbt->create_time);
+	g_key_file_set_string_list(next_chunk_plans, group, "chunks", list, n);
+	g_free(list);
+
+	/* Where each range starts and where the last one ends, read before any of them is dumped */
+	if (ranges) {
+		bounds= g_new0(gchar *, g_list_length(ranges) + 2);
+		for (i= 0, iter= ranges; iter; iter= g_list_next(iter), i++) {
+			kr= (struct key_range_chunk *)iter->data;
+			bounds[i]= g_strdup_printf("%" G_GINT64_FORMAT, kr->next);
+		}
+		bounds[i]= g_strdup_printf("%" G_GINT64_FORMAT, kr->to);
+		g_key_file_set_string(next_chunk_plans, group, "range_field", kr->field);
+		g_key_file_set_string_list(next_chunk_plans, group, "range_bounds", (const gchar * const *)bounds, i + 1);
+		g_strfreev(bounds);
+	}
+
+	zeros= g_new0(gdouble, n + 1);
+	g_key_file_set_double_list(next_chunk_plans, group, "chunk_rows", zeros, n);
+	g_key_file_set_double_list(next_chunk_plans, group, "chunk_seconds", zeros, n);
+	g_free(zeros);
+}
+
+static void copy_plan(gchar *group) {
+	gchar **keys= g_key_file_get_keys(chunk_plans, group, NULL, NULL);
+	gchar *value;
+	guint i;
+
+	for (i= 0; keys && keys[i]; i++) {
+		value= g_key_file_get_value(chunk_plans, group, keys[i], NULL);
+		g_key_file_set_value(next_chunk_plans, group, keys[i], value);
+		g_free(value);
+	}
+	g_strfreev(keys);
+}
+
+/* Chunks of a table. In daemon mode the previous snapshot's plan is used again, without a query, until the
+   table's statistics move or its chunks turned out uneven. */
+GList *get_planned_chunks(MYSQL *conn, struct db_table *dbt, struct configuration *conf, GList **ranges) {
+	guint64 rows_per_chunk= chunk_rows(dbt);
+	gchar *group;
+	GList *chunks;
+
+	if (!next_chunk_plans || !(group= plan_group(dbt->database, dbt->table)))
+		return get_chunks_for_table(conn, dbt->database, dbt->table, conf, rows_per_chunk, ranges);
+
+	g_mutex_lock(chunk_plans_mutex);
+	if (plan_is_current(group, dbt, rows_per_chunk, ranges != NULL)) {
+		chunks= get_plan_chunks(chunk_plans, group, ranges);
+		copy_plan(group);
+		g_mutex_unlock(chunk_plans_mutex);
+		g_free(group);
+		return chunks;
+	}
+	g_mutex_unlock(chunk_plans_mutex);
+
+	chunks= get_chunks_for_table(conn, dbt->database, dbt->table, conf, rows_per_chunk, ranges);
+	g_mutex_lock(chunk_plans_mutex);
+	set_plan(group, dbt, rows_per_chunk, ranges != NULL, chunks, ranges ? *ranges : NULL);
+	g_mutex_unlock(chunk_plans_mutex);
+	g_free(group);
+	return chunks;
+}
+
+/* Rows a chunk of a planned table had and how long it took, chunk counts from 1 */
+void remember_chunk_run(char *database, char *table, guint chunk, guint64 rows, gdouble seconds) {
+	const gchar *keys[]= { "chunk_rows", "chunk_seconds" };
+	gdouble values[]= { (gdouble)rows, seconds };
+	gdouble *list;
+	gsize n;
+	gchar *group;
+	guint i;
+
+	if (!next_chunk_plans || !chunk || !(group= plan_group(database, table)))
+		return;
+	g_mutex_lock(chunk_plans_mutex);
+	for (i= 0; i < G_N_ELEMENTS(keys); i++) {
+		n= 0;
+		list= g_key_file_get_double_list(next_chunk_plans, group, keys[i], &n, NULL);
+		if (chunk <= n) {
+			list[chunk-1]= values[i];
+			g_key_file_set_double_list(next_chunk_plans, group, keys[i], list, n);
+		}
+		g_free(list);
+	}
+	g_mutex_unlock(chunk_plans_mutex);
+	g_free(group);
+}
+
+GList * get_chunks_for_table(MYSQL *conn, char *database, char *table, struct configuration *conf, guint64 rows_per_chunk, GList **ranges) {
 
 	GList *chunks = NULL;
 	MYSQL_RES *indexes=NULL, *minmax=NULL, *total=NULL;
 	MYSQL_ROW row;
 	char *field = NULL;
-	int showed_nulls=0;
+	char *index = NULL;
+	GString *pk_columns = NULL;
+	guint pk_ncols = 0;
+	guint64 leading_cardinality = 0;
+	GList *boundaries = NULL;
+	gchar *quoted_field = NULL;
+	gboolean reliable = FALSE;
+
+	if (!rows_per_chunk)
+		return NULL;
 
 	/* first have to pick index, in future should be able to preset in configuration too */
 	gchar *query = g_strdup_printf("SHOW INDEX FROM `%s`.`%s`",database,table);
@@ -1637,11 +2172,19 @@ GList * get_chunks_for_table(MYSQL *conn, char *database, char *table, struct co
 	g_free(query);
 	indexes=mysql_store_result(conn);
 
+	pk_columns = g_string_sized_new(64);
 	while ((row=mysql_fetch_row(indexes))) {
-		if (!strcmp(row[2],"PRIMARY") && (!strcmp(row[3],"1"))) {
-			/* Pick first column in PK, cardinality doesn't matter */
-			field=row[4];
-			break;
+		if (!strcmp(row[2],"PRIMARY")) {
+			if (!strcmp(row[3],"1")) {
+				/* Pick first column in PK, cardinality doesn't matter */
+				field=row[4];
+				index=row[2];
+				if (row[6])
+					leading_cardinality = strtoll(row[6],NULL,10);
+			}
+			/* The whole key too, its first column alone may have too few values to split on */
+			g_string_append_printf(pk_columns, "%s`%s`", pk_ncols ? "," : "", row[4]);
+			pk_ncols++;
 		}
 	}
 
@@ -1652,6 +2195,7 @@ GList * get_chunks_for_table(MYSQL *conn, char *database, char *table, struct co
 			if(!strcmp(row[1],"0") && (!strcmp(row[3],"1"))) {
 				/* Again, first column of any unique index */
 				field=row[4];
+				index=row[2];
 				break;
 			}
 		}
@@ -1669,6 +2213,7 @@ GList * get_chunks_for_table(MYSQL *conn, char *database, char *table, struct co
 					cardinality = strtoll(row[6],NULL,10);
 				if (cardinality>max_cardinality) {
 					field=row[4];
+					index=row[2];
 					max_cardinality=cardinality;
 				}
 			}
@@ -1697,37 +2242,50 @@ GList * get_chunks_for_table(MYSQL *conn, char *database, char *table, struct co
 
 	/* Got total number of rows, skip chunk logic if estimates are low */
 	guint64 rows = estimate_count(conn, database, table, field, NULL, NULL);
-	if (rows <= rows_per_file)
+	if (rows <= rows_per_chunk)
 		goto cleanup;
 
 	/* This is estimate, not to use as guarantee! Every chunk would have eventual adjustments */
-	guint64 estimated_chunks = rows / rows_per_file;
-	guint64 estimated_step, nmin, nmax, cutoff;
+	guint64 estimated_chunks = rows / rows_per_chunk;
+	gboolean integer_key = fields[0].type == MYSQL_TYPE_LONG || fields[0].type == MYSQL_TYPE_LONGLONG || fields[0].type == MYSQL_TYPE_INT24;
+	gint64 nmin, nmax, cutoff, estimated_step;
+
+	/* Stepping over the first column of a composite key would give a few huge chunks, walk the whole key instead */
+	if (pk_ncols > 1 && (!integer_key || leading_cardinality < estimated_chunks * COMPOSITE_KEY_MIN_VALUES)) {
+		boundaries = get_key_boundaries(conn, database, table, "PRIMARY", pk_columns->str, NULL, rows_per_chunk);
+		chunks = get_key_chunks(pk_columns->str, boundaries, NULL);
+		/* A key that can't be walked still has its integer first column to step over */
+		if (chunks || !integer_key)
+			goto cleanup;
+	}
 
-	/* Support just bigger INTs for now, very dumb, no verify approach */
+	/* Bigger INTs are split on index estimates, everything else by walking the index */
 	switch (fields[0].type) {
 		case MYSQL_TYPE_LONG:
 		case MYSQL_TYPE_LONGLONG:
 		case MYSQL_TYPE_INT24:
-			/* static stepping */
-			nmin = strtoll(min,NULL,10);
-			nmax = strtoll(max,NULL,10);
-			estimated_step = (nmax-nmin)/estimated_chunks+1;
-			cutoff = nmin;
-			while(cutoff<=nmax) {
-				chunks=g_list_append(chunks,g_strdup_printf("%s%s%s%s(`%s` >= %llu AND `%s` < %llu)",
-						!showed_nulls?"`":"",
-						!showed_nulls?field:"",
-						!showed_nulls?"`":"",
-						!showed_nulls?" IS NULL OR ":"",
-						field, (unsigned long long)cutoff,
-						field, (unsigned long long)(cutoff+estimated_step)));
-				cutoff+=estimated_step;
-				showed_nulls=1;
+			/* Boundaries where the index says the rows are, gaps in the key don't make empty chunks */
+			quoted_field = g_strdup_printf("`%s`", field);
+			boundaries = get_range_boundaries(conn, database, table, field, min, max, rows, rows_per_chunk, &reliable);
+			if (!reliable) {
+				/* static stepping */
+				nmin = strtoll(min,NULL,10);
+				nmax = strtoll(max,NULL,10);
+				estimated_step = (gint64)(((guint64)nmax-(guint64)nmin)/estimated_chunks+1);
+				for (cutoff = nmin + estimated_step; cutoff > nmin && cutoff <= nmax; cutoff += estimated_step)
+					boundaries = g_list_append(boundaries, g_strdup_printf("(%lld)", (long long)cutoff));
 			}
+			chunks = get_key_chunks(quoted_field, boundaries, quoted_field);
+			if (ranges)
+				*ranges = get_key_ranges(quoted_field, boundaries, min, max, rows_per_chunk);
+			break;
 
 		default:
-			goto cleanup;
+			/* Dates, decimals, strings and binary keys are split wherever walking the index lands */
+			quoted_field = g_strdup_printf("`%s`", field);
+			boundaries = get_key_boundaries(conn, database, table, index, quoted_field, strcmp(index, "PRIMARY") ? quoted_field : NULL, rows_per_chunk);
+			chunks = get_key_chunks(quoted_field, boundaries, strcmp(index, "PRIMARY") ? quoted_field : NULL);
+			break;
 	}
 
 
@@ -1738,9 +2296,346 @@ cleanup:
 		mysql_free_result(minmax);
 	if (total)
 		mysql_free_result(total);
+	if (pk_columns)
+		g_string_free(pk_columns, TRUE);
+	g_list_foreach(boundaries, (GFunc)g_free, NULL);
+	g_list_free(boundaries);
+	g_free(quoted_field);
+	return chunks;
+}
+
+/* Slices a key range is read in, the unread ones can be taken over by idle threads */
+#define RANGE_SLICES 16
+
+/* Index dives, ranges bigger than a chunk are halved until they fit or this many were made */
+#define MAX_RANGE_DIVES 4096
+
+struct key_range {
+	gint64 from;
+	gint64 to;
+	guint64 rows;
+};
+
+static void split_range(MYSQL *conn, char *database, char *table, char *field, struct key_range *range, guint64 rows_per_chunk, GList **ranges, guint *dives, gboolean *reliable) {
+	struct key_range *low, *high;
+	gint64 middle;
+
+	if (*reliable && range->rows > rows_per_chunk && range->from < range->to && *dives < MAX_RANGE_DIVES) {
+		middle = range->from + (gint64)(((guint64)range->to - (guint64)range->from) / 2);
+		low = g_new(struct key_range, 1);
+		low->from = range->from;
+		low->to = middle;
+		low->rows = estimate_range(conn, database, table, field, low->from, low->to);
+		high = g_new(struct key_range, 1);
+		high->from = middle + 1;
+		high->to = range->to;
+		high->rows = estimate_range(conn, database, table, field, high->from, high->to);
+		*dives += 2;
+		/* Halves adding up to far more than the whole mean the optimizer isn't using the index */
+		if (low->rows + high->rows > 2 * range->rows + rows_per_chunk)
+			*reliable = FALSE;
+		g_free(range);
+		split_range(conn, database, table, field, low, rows_per_chunk, ranges, dives, reliable);
+		split_range(conn, database, table, field, high, rows_per_chunk, ranges, dives, reliable);
+		return;
+	}
+	*ranges = g_list_prepend(*ranges, range);
+}
+
+/* Equi-depth boundaries for an integer key: the key range is halved where the index
+   estimates hold more than a chunk of rows, then neighbouring pieces are merged back
+   until each holds a chunk, so empty stretches of the key end up inside a chunk.
+   Clears reliable when the estimates can't be trusted. */
+GList *get_range_boundaries(MYSQL *conn, char *database, char *table, char *field, char *min, char *max, guint64 rows, guint64 rows_per_chunk, gboolean *reliable) {
+	GList *ranges = NULL, *boundaries = NULL, *iter;
+	struct key_range *range = g_new(struct key_range, 1);
+	guint64 chunk_rows = 0;
+	guint dives = 0;
+
+	range->from = strtoll(min, NULL, 10);
+	range->to = strtoll(max, NULL, 10);
+	range->rows = rows;
+	*reliable = TRUE;
+	split_range(conn, database, table, field, range, rows_per_chunk, &ranges, &dives, reliable);
+	ranges = g_list_reverse(ranges);
+	for (iter = ranges; iter; iter = g_list_next(iter)) {
+		range = (struct key_range *)iter->data;
+		if (*reliable && chunk_rows >= rows_per_chunk) {
+			boundaries = g_list_append(boundaries, g_strdup_printf("(%lld)", (long long)range->from));
+			chunk_rows = 0;
+		}
+		chunk_rows += range->rows;
+	}
+	g_list_foreach(ranges, (GFunc)g_free, NULL);
+	g_list_free(ranges);
+	return boundaries;
+}
+
+/* EXPLAIN'ed estimate of the rows with the key between from and to, both included */
+guint64 estimate_range(MYSQL *conn, char *database, char *table, char *field, gint64 from, gint64 to) {
+	char *query = g_strdup_printf("EXPLAIN SELECT `%s` FROM `%s`.`%s` WHERE `%s` >= %lld AND `%s` <= %lld", field, database, table, field, (long long)from, field, (long long)to);
+	MYSQL_RES *result;
+	MYSQL_FIELD *fields;
+	MYSQL_ROW row;
+	guint64 count = 0;
+	guint i;
+
+	if (mysql_query(conn, query) || !(result = mysql_store_result(conn))) {
+		g_warning("Unable to get estimates for %s.%s: %s", database, table, mysql_error(conn));
+		g_free(query);
+		return 0;
+	}
+	g_free(query);
+	fields = mysql_fetch_fields(result);
+	for (i = 0; i < mysql_num_fields(result); i++)
+		if (!strcmp(fields[i].name, "rows"))
+			break;
+	if (i < mysql_num_fields(result) && (row = mysql_fetch_row(result)) && row[i])
+		count = strtoll(row[i], NULL, 10);
+	mysql_free_result(result);
+	return count;
+}
+
+/* Walks an index in steps of rows_per_chunk, every boundary is the key of the row
+   starting a chunk, written as a row constructor. NULLs in null_column are skipped. */
+GList *get_key_boundaries(MYSQL *conn, char *database, char *table, const char *index, char *columns, const char *null_column, guint64 rows_per_chunk) {
+	GList *boundaries = NULL;
+	GString *query = g_string_sized_new(256);
+	GString *tuple;
+	char *last = NULL;
+	MYSQL_RES *result;
+	MYSQL_ROW row;
+	unsigned long *lengths;
+	guint i;
+	char *escaped;
+	MYSQL_FIELD *fields;
+	gboolean strict = FALSE;
+
+	for (;;) {
+		g_string_printf(query, "SELECT %s %s FROM `%s`.`%s` FORCE INDEX (`%s`)", (detected_server == SERVER_TYPE_MYSQL) ? "/*!40001 SQL_NO_CACHE */" : "", columns, database, table, index);
+		if (last)
+			g_string_append_printf(query, " WHERE (%s) %s %s", columns, strict ? ">" : ">=", last);
+		else if (null_column)
+			g_string_append_printf(query, " WHERE %s IS NOT NULL", null_column);
+		g_string_append_printf(query, " ORDER BY %s LIMIT 1 OFFSET %llu", columns, strict ? 0ULL : (unsigned long long)rows_per_chunk);
+		if (mysql_query(conn, query->str) || !(result = mysql_store_result(conn))) {
+			g_warning("Unable to split %s.%s on %s, dumping it in one piece: %s", database, table, index, mysql_error(conn));
+			g_list_foreach(boundaries, (GFunc)g_free, NULL);
+			g_list_free(boundaries);
+			boundaries = NULL;
+			break;
+		}
+		if (!(row = mysql_fetch_row(result))) {
+			mysql_free_result(result);
+			break;
+		}
+		lengths = mysql_fetch_lengths(result);
+		fields = mysql_fetch_fields(result);
+		for (i = 0; i < mysql_num_fields(result) && is_exact_key_field(&fields[i]); i++);
+		if (i < mysql_num_fields(result)) {
+			g_warning("Unable to split %s.%s on %s, `%s` can't be compared in index order, dumping it in one piece", database, table, index, fields[i].name);
+			mysql_free_result(result);
+			g_list_foreach(boundaries, (GFunc)g_free, NULL);
+			g_list_free(boundaries);
+			boundaries = NULL;
+			break;
+		}
+		tuple = g_string_sized_new(64);
+		g_string_append_c(tuple, '(');
+		for (i = 0; i < mysql_num_fields(result); i++) {
+			if (i)
+				g_string_append_c(tuple, ',');
+			/* Binary keys go as hex, their bytes needn't be valid in the connection character set */
+			if (is_binary_field(&fields[i])) {
+				g_string_append(tuple, "X'");
+				g_string_append_hex(tuple, row[i], lengths[i]);
+				g_string_append_c(tuple, '\'');
+			} else {
+				escaped = g_new(char, lengths[i]*2+1);
+				mysql_real_escape_string(conn, escaped, row[i], lengths[i]);
+				g_string_append_printf(tuple, "'%s'", escaped);
+				g_free(escaped);
+			}
+		}
+		g_string_append_c(tuple, ')');
+		mysql_free_result(result);
+		/* A run of equal keys longer than a chunk, the next boundary is the next value */
+		if (last && !strcmp(tuple->str, last)) {
+			g_string_free(tuple, TRUE);
+			if (strict) {
+				/* Past the value the server still returns it, the key can't be walked */
+				g_warning("Unable to split %s.%s on %s, stuck at %s, dumping it in one piece", database, table, index, last);
+				g_list_foreach(boundaries, (GFunc)g_free, NULL);
+				g_list_free(boundaries);
+				boundaries = NULL;
+				break;
+			}
+			strict = TRUE;
+			continue;
+		}
+		strict = FALSE;
+		last = g_string_free(tuple, FALSE);
+		boundaries = g_list_append(boundaries, last);
+	}
+	g_string_free(query, TRUE);
+	return boundaries;
+}
+
+/* Ranges between consecutive boundaries, the first and last ones are open ended.
+   NULLs in null_column go with the first range. */
+GList *get_key_chunks(char *columns, GList *boundaries, const char *null_column) {
+	GList *chunks = NULL;
+	GList *iter;
+	char *previous = NULL;
+
+	if (!boundaries)
+		return NULL;
+	for (iter = g_list_first(boundaries); iter; iter = g_list_next(iter)) {
+		if (previous)
+			chunks = g_list_append(chunks, g_strdup_printf("(%s) >= %s AND (%s) < %s", columns, previous, columns, (char *)iter->data));
+		else if (null_column)
+			chunks = g_list_append(chunks, g_strdup_printf("%s IS NULL OR (%s) < %s", null_column, columns, (char *)iter->data));
+		else
+			chunks = g_list_append(chunks, g_strdup_printf("(%s) < %s", columns, (char *)iter->data));
+		previous = iter->data;
+	}
+	chunks = g_list_append(chunks, g_strdup_printf("(%s) >= %s", columns, previous));
 	return chunks;
 }
 
+/* Range of an integer key holding about rows rows */
+struct key_range_chunk *new_key_range(char *field, gint64 from, gint64 to, guint64 rows) {
+	struct key_range_chunk *kr = g_new0(struct key_range_chunk, 1);
+
+	kr->field = g_strdup(field);
+	kr->next = from;
+	kr->to = to;
+	kr->slice = MAX((gint64)(((guint64)to - (guint64)from) / RANGE_SLICES), 1);
+	kr->density = to > from ? (gdouble)rows / ((guint64)to - (guint64)from) : 0;
+	return kr;
+}
+
+/* The same ranges as get_key_chunks() gives for integer boundaries, as key ranges that can be split while they are dumped */
+GList *get_key_ranges(char *field, GList *boundaries, char *min, char *max, guint64 rows_per_chunk) {
+	GList *ranges = NULL;
+	GList *iter;
+	struct key_range_chunk *kr;
+	gint64 from = strtoll(min, NULL, 10);
+	gint64 to;
+
+	if (!boundaries)
+		return NULL;
+	for (iter = g_list_first(boundaries); ; iter = g_list_next(iter)) {
+		if (iter) {
+			to = strtoll((char *)iter->data + 1, NULL, 10);
+		} else {
+			/* Past the maximum, the last range is open ended anyway */
+			to = strtoll(max, NULL, 10);
+			to = to < G_MAXINT64 ? to + 1 : to;
+		}
+		kr = new_key_range(field, from, to, rows_per_chunk);
+		kr->first = !ranges;
+		kr->last = !iter;
+		ranges = g_list_append(ranges, kr);
+		if (!iter)
+			break;
+		from = to;
+	}
+	return ranges;
+}
+
+/* Hands out the next slice of a range as a WHERE clause, NULL once all of it was handed out */
+gchar *take_key_slice(struct key_range_chunk *kr) {
+	gchar *where = NULL;
+	gint64 from, to;
+	gboolean first, last;
+
+	g_mutex_lock(key_ranges_mutex);
+	if (kr->next < kr->to || kr->last) {
+		from = kr->next;
+		to = ((guint64)kr->to - (guint64)kr->next > (guint64)kr->slice) ? kr->next + kr->slice : kr->to;
+		first = kr->first;
+		last = kr->last && to == kr->to;
+		kr->next = to;
+		kr->first = FALSE;
+		if (first && last)
+			where = g_strdup("TRUE");
+		else if (first)
+			where = g_strdup_printf("%s IS NULL OR %s < %lld", kr->field, kr->field, (long long)to);
+		else if (last)
+			where = g_strdup_printf("%s >= %lld", kr->field, (long long)from);
+		else
+			where = g_strdup_printf("%s >= %lld AND %s < %lld", kr->field, (long long)from, kr->field, (long long)to);
+		/* Anything above the maximum is in the last slice */
+		if (last)
+			kr->last = FALSE;
+	}
+	g_mutex_unlock(key_ranges_mutex);
+	return where;
+}
+
+/* Splits the range with the most rows left in two and returns the half that hasn't been
+   started, for the calling thread to dump. NULL when no range is worth splitting. */
+struct key_range_chunk *steal_key_range(void) {
+	GList *iter;
+	struct key_range_chunk *kr, *best = NULL, *stolen = NULL;
+	gdouble left, most = 0;
+	guint64 keys;
+
+	g_mutex_lock(key_ranges_mutex);
+	for (iter = key_ranges; iter; iter = g_list_next(iter)) {
+		kr = (struct key_range_chunk *)iter->data;
+		if (kr->next >= kr->to)
+			continue;
+		keys = (guint64)kr->to - (guint64)kr->next;
+		left = keys * kr->density;
+		if (keys >= 2 * (guint64)kr->slice && left > most) {
+			best = kr;
+			most = left;
+		}
+	}
+	if (best) {
+		stolen = g_new0(struct key_range_chunk, 1);
+		stolen->database = g_strdup(best->database);
+		stolen->table = g_strdup(best->table);
+		stolen->field = g_strdup(best->field);
+		stolen->next = best->next + (gint64)(((guint64)best->to - (guint64)best->next) / 2);
+		stolen->to = best->to;
+		stolen->slice = best->slice;
+		stolen->last = best->last;
+		stolen->density = best->density;
+		stolen->owner = best->owner;
+		stolen->owner->refs++;
+		stolen->filename = g_strdup_printf("%s.%05d.sql%s", stolen->owner->prefix, stolen->owner->chunks++, codec_extension(output_codec));
+		best->to = stolen->next;
+		best->last = FALSE;
+	}
+	g_mutex_unlock(key_ranges_mutex);
+	return stolen;
+}
+
+/* Makes a range visible to threads looking for work while it is being dumped */
+void register_key_range(struct key_range_chunk *kr) {
+	g_mutex_lock(key_ranges_mutex);
+	key_ranges = g_list_prepend(key_ranges, kr);
+	g_mutex_unlock(key_ranges_mutex);
+}
+
+void finish_key_range(struct key_range_chunk *kr) {
+	g_mutex_lock(key_ranges_mutex);
+	key_ranges = g_list_remove(key_ranges, kr);
+	if (!--kr->owner->refs) {
+		g_free(kr->owner->prefix);
+		g_free(kr->owner);
+	}
+	g_mutex_unlock(key_ranges_mutex);
+	g_free(kr->database);
+	g_free(kr->table);
+	g_free(kr->filename);
+	g_free(kr->field);
+	g_free(kr);
+}
+
 /* Try to get EXPLAIN'ed estimates of row in resultset */
 guint64 estimate_count(MYSQL *conn, char *database, char *table, char *field, char *from, char *to) {
 	char *querybase, *query;
@@ -1806,6 +2701,14 @@ guint64 estimate_count(MYSQL *conn, char *database, char *table, char *field, ch
 	return(count);
 }
 
+/* Picks the sizes and creation time out of a SHOW TABLE STATUS row, columns the server didn't return are -1 */
+void set_table_stats(struct db_table *dbt, MYSQL_ROW row, int rcol, int acol, int dcol, int tcol) {
+	dbt->rows= (rcol >= 0 && row[rcol]) ? g_ascii_strtoull(row[rcol], NULL, 10) : 0;
+	dbt->avg_row_length= (acol >= 0 && row[acol]) ? g_ascii_strtoull(row[acol], NULL, 10) : 0;
+	dbt->datalength= (dcol >= 0 && row[dcol]) ? g_ascii_strtoull(row[dcol], NULL, 10) : 0;
+	dbt->create_time= (tcol >= 0 && row[tcol]) ? g_strdup(row[tcol]) : NULL;
+}
+
 void create_backup_dir(char *new_directory) {
 	if (g_mkdir(new_directory, 0700) == -1)
 	{
@@ -1819,41 +2722,133 @@ void create_backup_dir(char *new_directory) {
 	}
 }
 
+/* information_schema.TABLES columns under the names SHOW TABLE STATUS gives them, it reads the same cached statistics */
+#define TABLE_STATUS_COLUMNS "TABLE_NAME AS Name, ENGINE AS Engine, IF(TABLE_TYPE='VIEW', 'VIEW', TABLE_COMMENT) AS Comment, TABLE_ROWS AS `Rows`, AVG_ROW_LENGTH AS Avg_row_length, DATA_LENGTH AS Data_length, CREATE_TIME AS Create_time, TABLE_SCHEMA AS Db"
+
+/* From this many databases on their tables are listed by the threads */
+#define DISCOVERY_SPLIT_DATABASES 256
+
 void dump_database(MYSQL * conn, char *database, FILE *file, struct configuration *conf) {
 
-	GList *iter = NULL;
 	char *query;
+	char *escaped= g_new(char, strlen(database)*2+1);
 	mysql_select_db(conn,database);
+	mysql_real_escape_string(conn, escaped, database, strlen(database));
 	if (detected_server == SERVER_TYPE_MYSQL)
-		query= g_strdup("SHOW TABLE STATUS");
+		query= g_strdup_printf("SELECT %s FROM information_schema.TABLES WHERE TABLE_SCHEMA='%s'", TABLE_STATUS_COLUMNS, escaped);
 	else
-		query= g_strdup_printf("SELECT TABLE_NAME, ENGINE, TABLE_TYPE as COMMENT FROM DATA_DICTIONARY.TABLES WHERE TABLE_SCHEMA='%s'", database);
+		query= g_strdup_printf("SELECT TABLE_NAME, ENGINE, TABLE_TYPE as COMMENT FROM DATA_DICTIONARY.TABLES WHERE TABLE_SCHEMA='%s'", escaped);
+	g_free(escaped);
 
 	if (mysql_query(conn, (query))) {
 		g_critical("Error: DB: %s - Could not execute query: %s", database, mysql_error(conn));
 		errors++;
+		g_free(query);
 		return;
 	}
+	g_free(query);
 
 	MYSQL_RES *result = mysql_store_result(conn);
+	if (!result) {
+		g_critical("Could not list tables for %s: %s", database, mysql_error(conn));
+		errors++;
+		return;
+	}
+	add_tables(conn, result, database, file, conf);
+	mysql_free_result(result);
+
+	find_schema_post(conn, database);
+	if(file)
+		fflush(file);
+}
+
+/* All tables of the databases in information_schema queries. With many databases the queries are split in groups
+   that the threads run on their connections, while this thread filters the tables they found. */
+void get_all_tables(MYSQL *conn, GList *databases, FILE *file, struct configuration *conf) {
+	guint groups= (!less_locking && g_list_length(databases) >= DISCOVERY_SPLIT_DATABASES) ? num_threads : 1;
+	GString **lists= g_new0(GString *, groups);
+	GAsyncQueue *done;
+	GList *iter;
+	struct discovery_job *dj;
+	MYSQL_RES *result= NULL;
+	char *escaped;
+	guint n, queued= 0;
+
+	for (n= 0; n < groups; n++)
+		lists[n]= g_string_sized_new(1024);
+	for (iter= databases, n= 0; iter; iter= g_list_next(iter), n= (n + 1) % groups) {
+		escaped= g_new(char, strlen((char *)iter->data)*2+1);
+		mysql_real_escape_string(conn, escaped, (char *)iter->data, strlen((char *)iter->data));
+		g_string_append_printf(lists[n], "%s'%s'", lists[n]->len ? "," : "", escaped);
+		g_free(escaped);
+	}
+
+	if (groups == 1) {
+		char *query= g_strdup_printf("SELECT %s FROM information_schema.TABLES WHERE TABLE_SCHEMA IN (%s) ORDER BY TABLE_SCHEMA", TABLE_STATUS_COLUMNS, lists[0]->str);
+		if (lists[0]->len && (mysql_query(conn, query) || !(result= mysql_store_result(conn)))) {
+			g_critical("Could not list tables: %s", mysql_error(conn));
+			errors++;
+		} else if (lists[0]->len) {
+			add_tables(conn, result, NULL, file, conf);
+			mysql_free_result(result);
+		}
+		g_free(query);
+	} else {
+		done= g_async_queue_new();
+		for (n= 0; n < groups; n++) {
+			struct job *j= g_new0(struct job,1);
+			dj= g_new0(struct discovery_job,1);
+			dj->query= g_strdup_printf("SELECT %s FROM information_schema.TABLES WHERE TABLE_SCHEMA IN (%s) ORDER BY TABLE_SCHEMA", TABLE_STATUS_COLUMNS, lists[n]->str);
+			dj->done= done;
+			j->job_data=(void*) dj;
+			j->conf=conf;
+			j->type=JOB_DISCOVER;
+			g_async_queue_push(conf->queue,j);
+			queued++;
+		}
+		for (n= 0; n < queued; n++) {
+			dj= (struct discovery_job *)g_async_queue_pop(done);
+			if (dj->result) {
+				add_tables(conn, dj->result, NULL, file, conf);
+				mysql_free_result(dj->result);
+			}
+			g_free(dj->query);
+			g_free(dj);
+		}
+		g_async_queue_unref(done);
+	}
+
+	for (n= 0; n < groups; n++)
+		g_string_free(lists[n], TRUE);
+	g_free(lists);
+	if(file)
+		fflush(file);
+}
+
+/* Filters the tables of a SHOW TABLE STATUS like result and queues or keeps those that are dumped. The database
+   is taken from a Db column when the result has one. */
+void add_tables(MYSQL *conn, MYSQL_RES *result, char *database, FILE *file, struct configuration *conf) {
+
+	GList *iter = NULL;
 	MYSQL_FIELD *fields= mysql_fetch_fields(result);
 	guint i;
-	int ecol= -1, ccol= -1;
+	int ecol= -1, ccol= -1, rcol= -1, acol= -1, dcol= -1, tcol= -1, bcol= -1;
 	for (i=0; i<mysql_num_fields(result); i++) {
 		if (!strcasecmp(fields[i].name, "Engine")) ecol= i;
 		else if (!strcasecmp(fields[i].name, "Comment")) ccol= i;
-	}
-
-	if (!result) {
-		g_critical("Could not list tables for %s: %s", database, mysql_error(conn));
-		errors++;
-		return;
+		else if (!strcasecmp(fields[i].name, "Rows")) rcol= i;
+		else if (!strcasecmp(fields[i].name, "Avg_row_length")) acol= i;
+		else if (!strcasecmp(fields[i].name, "Data_length")) dcol= i;
+		else if (!strcasecmp(fields[i].name, "Create_time")) tcol= i;
+		else if (!strcasecmp(fields[i].name, "Db")) bcol= i;
 	}
 
 	MYSQL_ROW row;
 	while ((row = mysql_fetch_row(result))) {
 
 		int dump=1;
+		if (bcol >= 0)
+			database= row[bcol];
 		int is_view=0;
 
 		/* We now do care about views!
@@ -1931,10 +2926,7 @@ void dump_database(MYSQL * conn, char *database, FILE *file, struct configuratio
 		struct db_table *dbt = g_new(struct db_table, 1);
 		dbt->database= g_strdup(database);
 		dbt->table= g_strdup(row[0]);
-		if(!row[6])
-			dbt->datalength = 0;
-		else
-			dbt->datalength = g_ascii_strtoull(row[6], NULL, 10);
+		set_table_stats(dbt, row, rcol, acol, dcol, tcol);
 		//if is a view we care only about schema
 		if(!is_view){
 			// with trx_consistency_only we dump all as innodb_tables
@@ -1942,7 +2934,7 @@ void dump_database(MYSQL * conn, char *database, FILE *file, struct configuratio
 			if(!no_data){
 				if(row[ecol] != NULL && g_ascii_strcasecmp("MRG_MYISAM", row[ecol])){
 					if (trx_consistency_only) {
-						dump_table(conn, dbt->database, dbt->table, conf, TRUE);
+						plan_table(conn, dbt, conf);
 					}else if (row[ecol] != NULL && !g_ascii_strcasecmp("InnoDB", row[ecol])) {
 						innodb_tables= g_list_append(innodb_tables, dbt);
 					}else if(row[ecol] != NULL && !g_ascii_strcasecmp("TokuDB", row[ecol])){
@@ -1961,6 +2953,13 @@ void dump_database(MYSQL * conn, char *database, FILE *file, struct configuratio
 			}
 		}
 	}
+}
+
+/* Stored procedures, functions and events of a database */
+void find_schema_post(MYSQL *conn, char *database) {
+	char *query = NULL;
+	MYSQL_RES *result = NULL;
+	MYSQL_ROW row;
 
 	//Store Procedures and Events
 	//As these are not attached to tables we need to define when we need to dump or not
@@ -2032,11 +3031,8 @@ void dump_database(MYSQL * conn, char *database, FILE *file, struct configuratio
 	}
 
 	g_free(query);
-	mysql_free_result(result);
-	if(file)
-		fflush(file);
-
-	return;
+	if (result)
+		mysql_free_result(result);
 }
 
 void get_tables(MYSQL * conn, struct configuration *conf) {
@@ -2059,9 +3055,14 @@ void get_tables(MYSQL * conn, struct configuration *conf) {
 		MYSQL_FIELD *fields= mysql_fetch_fields(result);
 		guint ecol= -1; 
 		guint ccol= -1;
+		int rcol= -1, acol= -1, dcol= -1, tcol= -1;
 		for (i=0; i<mysql_num_fields(result); i++) {
 			if (!strcasecmp(fields[i].name, "Engine")) ecol= i;
 			else if (!strcasecmp(fields[i].name, "Comment")) ccol= i;
+			else if (!strcasecmp(fields[i].name, "Rows")) rcol= i;
+			else if (!strcasecmp(fields[i].name, "Avg_row_length")) acol= i;
+			else if (!strcasecmp(fields[i].name, "Data_length")) dcol= i;
+			else if (!strcasecmp(fields[i].name, "Create_time")) tcol= i;
 		}
 
 		if (!result) {
@@ -2082,13 +3083,10 @@ void get_tables(MYSQL * conn, struct configuration *conf) {
 			struct db_table *dbt = g_new(struct db_table, 1);
 			dbt->database= g_strdup(dt[0]);
 			dbt->table= g_strdup(dt[1]);
-			if(!row[6])
-				dbt->datalength = 0;
-			else
-				dbt->datalength = g_ascii_strtoull(row[6], NULL, 10);
+			set_table_stats(dbt, row, rcol, acol, dcol, tcol);
 			if(!is_view){
 				if (trx_consistency_only) {
-					dump_table(conn, dbt->database, dbt->table, conf, TRUE);
+					plan_table(conn, dbt, conf);
 				}else if (!g_ascii_strcasecmp("InnoDB", row[ecol])) {
 					innodb_tables= g_list_append(innodb_tables, dbt);
 				}else if(!g_ascii_strcasecmp("TokuDB", row[ecol])){
@@ -2422,13 +3420,8 @@ void dump_view_data(MYSQL *conn, char *database, char *table, char *filename, ch
 
 	mysql_select_db(conn,database);
 
-	if (!compress_output){
-		outfile= g_fopen(filename, "w");
-		outfile2= g_fopen(filename2, "w");
-	}else{
-		outfile= (void*) gzopen(filename, "w");
-		outfile2= (void*) gzopen(filename2, "w");
-	}
+	outfile= open_file(filename);
+	outfile2= open_file(filename2);
 
 	if (!outfile || !outfile2) {
 		g_critical("Error: DB: %s Could not create output file (%d)", database, errno);
@@ -2519,18 +3512,28 @@ void dump_view_data(MYSQL *conn, char *database, char *table, char *filename, ch
 	return;
 }
 
-void dump_table_data_file(MYSQL *conn, char *database, char *table, char *where, char *filename) {
+void dump_table_data_file(MYSQL *conn, char *database, char *table, char *where, char *partition, char *filename, struct thread_data *td, struct key_range_chunk *range, guint chunk) {
 	void *outfile=NULL;
+	GTimer *timer;
 	if (destination_type!=STDOUT){
-		outfile=open_file(filename);
+		outfile= writer_pool ? open_data_file(filename) : open_file(filename);
 		if (!outfile) {
 			g_critical("Error: DB: %s TABLE: %s Could not create output file %s (%d)", database, table, filename, errno);
 			errors++;
+			if (range)
+				finish_key_range(range);
 			return;
 		}
 	}
 
-	guint64 rows_count = dump_table_data(conn, (FILE *)outfile, database, table, where, filename);
+	if (range)
+		register_key_range(range);
+	timer = g_timer_new();
+	guint64 rows_count = dump_table_data(conn, (FILE *)outfile, database, table, where, partition, filename, td, range);
+	remember_chunk_run(database, table, chunk, rows_count, g_timer_elapsed(timer, NULL));
+	g_timer_destroy(timer);
+	if (range)
+		finish_key_range(range);
 	
 	if (!rows_count)
 		g_message("Empty table %s.%s", database,table);
@@ -2545,9 +3548,9 @@ void dump_schema(MYSQL *conn, char *database, char *table, struct configuration
 	j->conf=conf;
 	j->type=JOB_SCHEMA;
 	if (daemon_mode)
-		sj->filename = g_strdup_printf("%s/%d/%s.%s-schema.sql%s", output_directory, dump_number, database, table, (compress_output?".gz":""));
+		sj->filename = g_strdup_printf("%s/%d/%s.%s-schema.sql%s", output_directory, dump_number, database, table, codec_extension(output_codec));
 	else
-		sj->filename = g_strdup_printf("%s/%s.%s-schema.sql%s", output_directory, database, table, (compress_output?".gz":""));
+		sj->filename = g_strdup_printf("%s/%s.%s-schema.sql%s", output_directory, database, table, codec_extension(output_codec));
 	g_async_queue_push(conf->queue,j);
 	if(dump_triggers){
 		char *query = NULL;
@@ -2581,9 +3584,9 @@ void enqueue_triggers_job(char *database, char *table, struct configuration *con
 	t->conf=conf;
 	t->type=JOB_TRIGGERS;
 	if (daemon_mode)
-		st->filename = g_strdup_printf("%s/%d/%s.%s-schema-triggers.sql%s", output_directory, dump_number, database, table, (compress_output?".gz":""));
+		st->filename = g_strdup_printf("%s/%d/%s.%s-schema-triggers.sql%s", output_directory, dump_number, database, table, codec_extension(output_codec));
 	else
-		st->filename = g_strdup_printf("%s/%s.%s-schema-triggers.sql%s", output_directory, database, table, (compress_output?".gz":""));
+		st->filename = g_strdup_printf("%s/%s.%s-schema-triggers.sql%s", output_directory, database, table, codec_extension(output_codec));
 	g_async_queue_push(conf->queue,t);
 	return;
 }
@@ -2597,11 +3600,11 @@ void dump_view(char *database, char *table, struct configuration *conf) {
 	j->conf=conf;
 	j->type=JOB_VIEW;
 	if (daemon_mode){
-		vj->filename = g_strdup_printf("%s/%d/%s.%s-schema.sql%s", output_directory, dump_number, database, table, (compress_output?".gz":""));
-		vj->filename2 = g_strdup_printf("%s/%d/%s.%s-schema-view.sql%s", output_directory, dump_number, database, table, (compress_output?".gz":""));
+		vj->filename = g_strdup_printf("%s/%d/%s.%s-schema.sql%s", output_directory, dump_number, database, table, codec_extension(output_codec));
+		vj->filename2 = g_strdup_printf("%s/%d/%s.%s-schema-view.sql%s", output_directory, dump_number, database, table, codec_extension(output_codec));
 	}else{
-		vj->filename = g_strdup_printf("%s/%s.%s-schema.sql%s", output_directory, database, table, (compress_output?".gz":""));
-		vj->filename2 = g_strdup_printf("%s/%s.%s-schema-view.sql%s", output_directory, database, table, (compress_output?".gz":""));
+		vj->filename = g_strdup_printf("%s/%s.%s-schema.sql%s", output_directory, database, table, codec_extension(output_codec));
+		vj->filename2 = g_strdup_printf("%s/%s.%s-schema-view.sql%s", output_directory, database, table, codec_extension(output_codec));
 	}
 	g_async_queue_push(conf->queue,j);
 	return;
@@ -2615,24 +3618,42 @@ void dump_schema_post(char *database, struct configuration *conf) {
 	j->conf=conf;
 	j->type=JOB_SCHEMA_POST;
 	if (daemon_mode){
-		sp->filename = g_strdup_printf("%s/%d/%s-schema-post.sql%s", output_directory, dump_number, database, (compress_output?".gz":""));
+		sp->filename = g_strdup_printf("%s/%d/%s-schema-post.sql%s", output_directory, dump_number, database, codec_extension(output_codec));
 	}else{
-		sp->filename = g_strdup_printf("%s/%s-schema-post.sql%s", output_directory, database, (compress_output?".gz":""));
+		sp->filename = g_strdup_printf("%s/%s-schema-post.sql%s", output_directory, database, codec_extension(output_codec));
 	}
 	g_async_queue_push(conf->queue,j);
 	return;
 }
 
-void dump_table(MYSQL *conn, char *database, char *table, struct configuration *conf, gboolean is_innodb) {
+void dump_table(MYSQL *conn, struct db_table *dbt, struct configuration *conf, gboolean is_innodb) {
 
+	char *database= dbt->database;
+	char *table= dbt->table;
 	GList * chunks = NULL;
-	if (rows_per_file)
-		chunks = get_chunks_for_table(conn, database, table, conf);
-
+	GList * ranges = NULL;
+	struct key_range_table *krt = NULL;
+	GList * partitions = NULL;
+	/* Partitions are chunks that cost nothing to plan */
+	if (split_partitions)
+		partitions = get_partitions(conn, database, table);
+	/* Only InnoDB chunks run in consistent snapshots that any thread can continue */
+	if (!partitions && (rows_per_file || chunk_size))
+		chunks = get_planned_chunks(conn, dbt, conf, is_innodb ? &ranges : NULL);
+
+	if (ranges) {
+		krt = g_new0(struct key_range_table, 1);
+		if (daemon_mode)
+			krt->prefix = g_strdup_printf("%s/%d/%s.%s", output_directory, dump_number, database, table);
+		else
+			krt->prefix = g_strdup_printf("%s/%s.%s", output_directory, database, table);
+		krt->chunks = krt->refs = g_list_length(ranges);
+	}
 
-	if (chunks) {
-		int nchunk=0;
-		for (chunks = g_list_first(chunks); chunks; chunks=g_list_next(chunks)) {
+	if (partitions) {
+		int npartition=0;
+		guint njobs=g_list_length(partitions);
+		for (partitions = g_list_first(partitions); partitions; partitions=g_list_next(partitions)) {
 			struct job *j = g_new0(struct job,1);
 			struct table_job *tj = g_new0(struct table_job,1);
 			j->job_data=(void*) tj;
@@ -2641,16 +3662,52 @@ void dump_table(MYSQL *conn, char *database, char *table, struct configuration *
 			j->conf=conf;
 			j->type= is_innodb ? JOB_DUMP : JOB_DUMP_NON_INNODB;
 			if (daemon_mode)
-				tj->filename=g_strdup_printf("%s/%d/%s.%s.%05d.sql%s", output_directory, dump_number, database, table, nchunk,(compress_output?".gz":""));
+				tj->filename=g_strdup_printf("%s/%d/%s.%s.%05d.sql%s", output_directory, dump_number, database, table, npartition,codec_extension(output_codec));
 			else
-				tj->filename=g_strdup_printf("%s/%s.%s.%05d.sql%s", output_directory, database, table, nchunk,(compress_output?".gz":""));
-			tj->where=(char *)chunks->data;
+				tj->filename=g_strdup_printf("%s/%s.%s.%05d.sql%s", output_directory, database, table, npartition,codec_extension(output_codec));
+			tj->partition=(char *)partitions->data;
+			if (!npartition)
+				set_table_dict_jobs(tj->filename, njobs);
+			if (!is_innodb && npartition)
+				g_atomic_int_inc(&non_innodb_table_counter);
+			g_async_queue_push(conf->queue,j);
+			npartition++;
+		}
+		g_list_free(g_list_first(partitions));
+	} else if (chunks) {
+		int nchunk=0;
+		GList *range_iter=ranges;
+		guint njobs=g_list_length(chunks);
+		for (chunks = g_list_first(chunks); chunks; chunks=g_list_next(chunks)) {
+			struct job *j = g_new0(struct job,1);
+			struct table_job *tj = g_new0(struct table_job,1);
+			j->job_data=(void*) tj;
+			tj->database=g_strdup(database);
+			tj->table=g_strdup(table);
+			j->conf=conf;
+			j->type= is_innodb ? JOB_DUMP : JOB_DUMP_NON_INNODB;
+			if (daemon_mode)
+				tj->filename=g_strdup_printf("%s/%d/%s.%s.%05d.sql%s", output_directory, dump_number, database, table, nchunk,codec_extension(output_codec));
+			else
+				tj->filename=g_strdup_printf("%s/%s.%s.%05d.sql%s", output_directory, database, table, nchunk,codec_extension(output_codec));
+			tj->where=(char *)chunks->data;
+			tj->chunk=nchunk+1;
+			if (!nchunk)
+				set_table_dict_jobs(tj->filename, njobs);
+			if (krt) {
+				tj->range=(struct key_range_chunk *)range_iter->data;
+				range_iter=g_list_next(range_iter);
+				tj->range->database=g_strdup(database);
+				tj->range->table=g_strdup(table);
+				tj->range->owner=krt;
+			}
 			if (!is_innodb && nchunk)
                                 g_atomic_int_inc(&non_innodb_table_counter);
 			g_async_queue_push(conf->queue,j);
 			nchunk++;
 		}
 		g_list_free(g_list_first(chunks));
+		g_list_free(ranges);
 	} else {
 		struct job *j = g_new0(struct job,1);
 		struct table_job *tj = g_new0(struct table_job,1);
@@ -2659,15 +3716,45 @@ void dump_table(MYSQL *conn, char *database, char *table, struct configuration *
 		tj->table=g_strdup(table);
 		j->conf=conf;
 		j->type= is_innodb ? JOB_DUMP : JOB_DUMP_NON_INNODB;
-		if (daemon_mode)
-			tj->filename = g_strdup_printf("%s/%d/%s.%s%s.sql%s", output_directory, dump_number, database, table,(chunk_filesize?".00001":""),(compress_output?".gz":""));
+		/* Files of a single scan are numbered like chunks, filename is what they start with */
+		tj->scan_files= scan_files_for_table(dbt);
+		if (tj->scan_files && daemon_mode)
+			tj->filename = g_strdup_printf("%s/%d/%s.%s", output_directory, dump_number, database, table);
+		else if (tj->scan_files)
+			tj->filename = g_strdup_printf("%s/%s.%s", output_directory, database, table);
+		else if (daemon_mode)
+			tj->filename = g_strdup_printf("%s/%d/%s.%s%s.sql%s", output_directory, dump_number, database, table,(chunk_filesize?".00001":""),codec_extension(output_codec));
 		else
-			tj->filename = g_strdup_printf("%s/%s.%s%s.sql%s", output_directory, database, table,(chunk_filesize?".00001":""),(compress_output?".gz":""));
+			tj->filename = g_strdup_printf("%s/%s.%s%s.sql%s", output_directory, database, table,(chunk_filesize?".00001":""),codec_extension(output_codec));
+		if (!tj->scan_files && chunk_filesize)
+			set_table_dict_jobs(tj->filename, 1);
 		g_async_queue_push(conf->queue,j);
 		return;
 	}
 }
 
+/* Tables read in the threads' snapshots are split by a thread, in its snapshot and in parallel with other tables.
+   Without chunks or partitions there is nothing to query and the job is queued right away. */
+void plan_table(MYSQL *conn, struct db_table *dbt, struct configuration *conf) {
+	struct job *j;
+	struct db_table *pdbt;
+
+	if (!rows_per_file && !chunk_size && !split_partitions) {
+		dump_table(conn, dbt, conf, TRUE);
+		return;
+	}
+	pdbt = g_new(struct db_table, 1);
+	*pdbt = *dbt;
+	pdbt->database = g_strdup(dbt->database);
+	pdbt->table = g_strdup(dbt->table);
+	pdbt->create_time = g_strdup(dbt->create_time);
+	j = g_new0(struct job,1);
+	j->job_data=(void*) pdbt;
+	j->conf=conf;
+	j->type=JOB_PLAN;
+	g_async_queue_push(conf->queue,j);
+}
+
 void dump_tables(MYSQL *conn, GList *noninnodb_tables_list, struct configuration *conf){
 	struct db_table* dbt;
 	GList * chunks = NULL;
@@ -2681,20 +3768,24 @@ void dump_tables(MYSQL *conn, GList *noninnodb_tables_list, struct configuration
 	for (noninnodb_tables_list= g_list_first(noninnodb_tables_list); noninnodb_tables_list; noninnodb_tables_list= g_list_next(noninnodb_tables_list)) {
 		dbt = (struct db_table*) noninnodb_tables_list->data;
 
-		if (rows_per_file)
-			chunks = get_chunks_for_table(conn, dbt->database, dbt->table, conf);
+		if (rows_per_file || chunk_size)
+			chunks = get_planned_chunks(conn, dbt, conf, NULL);
 
 		if(chunks){
 			int nchunk=0;
+			guint njobs=g_list_length(chunks);
 			for (chunks = g_list_first(chunks); chunks; chunks=g_list_next(chunks)) {
 				struct table_job *tj = g_new0(struct table_job,1);
 				tj->database = g_strdup_printf("%s",dbt->database);
 				tj->table = g_strdup_printf("%s",dbt->table);
 				if (daemon_mode)
-					tj->filename=g_strdup_printf("%s/%d/%s.%s.%05d.sql%s", output_directory, dump_number, dbt->database, dbt->table, nchunk,(compress_output?".gz":""));
+					tj->filename=g_strdup_printf("%s/%d/%s.%s.%05d.sql%s", output_directory, dump_number, dbt->database, dbt->table, nchunk,codec_extension(output_codec));
 				else
-					tj->filename=g_strdup_printf("%s/%s.%s.%05d.sql%s", output_directory, dbt->database, dbt->table, nchunk,(compress_output?".gz":""));
+					tj->filename=g_strdup_printf("%s/%s.%s.%05d.sql%s", output_directory, dbt->database, dbt->table, nchunk,codec_extension(output_codec));
 				tj->where=(char *)chunks->data;
+				tj->chunk=nchunk+1;
+				if (!nchunk)
+					set_table_dict_jobs(tj->filename, njobs);
 				tjs->table_job_list= g_list_append(tjs->table_job_list, tj);
 				nchunk++;
 			}
@@ -2702,278 +3793,2054 @@ void dump_tables(MYSQL *conn, GList *noninnodb_tables_list, struct configuration
 			struct table_job *tj = g_new0(struct table_job,1);
 			tj->database = g_strdup_printf("%s",dbt->database);
 			tj->table = g_strdup_printf("%s",dbt->table);
-			if (daemon_mode)
-				tj->filename = g_strdup_printf("%s/%d/%s.%s%s.sql%s", output_directory, dump_number, dbt->database, dbt->table,(chunk_filesize?".00001":""),(compress_output?".gz":""));
+			tj->scan_files= scan_files_for_table(dbt);
+			if (tj->scan_files && daemon_mode)
+				tj->filename = g_strdup_printf("%s/%d/%s.%s", output_directory, dump_number, dbt->database, dbt->table);
+			else if (tj->scan_files)
+				tj->filename = g_strdup_printf("%s/%s.%s", output_directory, dbt->database, dbt->table);
+			else if (daemon_mode)
+				tj->filename = g_strdup_printf("%s/%d/%s.%s%s.sql%s", output_directory, dump_number, dbt->database, dbt->table,(chunk_filesize?".00001":""),codec_extension(output_codec));
 			else
-				tj->filename = g_strdup_printf("%s/%s.%s%s.sql%s", output_directory, dbt->database, dbt->table,(chunk_filesize?".00001":""),(compress_output?".gz":""));
+				tj->filename = g_strdup_printf("%s/%s.%s%s.sql%s", output_directory, dbt->database, dbt->table,(chunk_filesize?".00001":""),codec_extension(output_codec));
 			tj->where = NULL;
+			if (!tj->scan_files && chunk_filesize)
+				set_table_dict_jobs(tj->filename, 1);
 			tjs->table_job_list= g_list_append(tjs->table_job_list, tj);
 		}
 	}
 	g_async_queue_push(conf->queue_less_locking,j);
 }
 
-/* Do actual data chunk reading/writing magic */
-guint64 dump_table_data(MYSQL * conn, FILE *file, char *database, char *table, char *where, char *filename)
-{
-	guint i;
-	guint fn = 1;
-	guint st_in_file = 0;
-	guint num_fields = 0;
-	guint64 num_rows = 0;
-	guint64 num_rows_st = 0;
-	MYSQL_RES *result = NULL;
-	char *query = NULL;
-	gchar *fcfile = NULL;
-	gchar* filename_prefix = NULL;
-	
-	fcfile = g_strdup (filename);
-	
-	if(chunk_filesize){
-		gchar** split_filename= g_strsplit(filename, ".00001.sql", 0);
-		filename_prefix= split_filename[0];
-		g_free(split_filename);
-	}
+/* Column buffers start at most this big, bigger values grow them for as long as the row is being written */
+#define FIELD_BUFFER_SIZE 16384
 
-	
-	/* Ghm, not sure if this should be statement_size - but default isn't too big for now */
-	GString* statement = g_string_sized_new(statement_size);
-	GString* statement_row = g_string_sized_new(0);
-	
-	/* Poor man's database code */
- 	query = g_strdup_printf("SELECT %s * FROM `%s`.`%s` %s %s", (detected_server == SERVER_TYPE_MYSQL) ? "/*!40001 SQL_NO_CACHE */" : "", database, table, where?"WHERE":"",where?where:"");
-	if (mysql_query(conn, query) || !(result=mysql_use_result(conn))) {
-		//ERROR 1146 
-		if(success_on_1146 && mysql_errno(conn) == 1146){
-			g_warning("Error dumping table (%s.%s) data: %s ",database, table, mysql_error(conn));
-		}else{
-			g_critical("Error dumping table (%s.%s) data: %s ",database, table, mysql_error(conn));
-			errors++;
+/* Size buffers for a binary protocol result, reusing whatever the thread allocated for previous tables */
+void prepare_stmt_buffers(struct stmt_buffers *sb, MYSQL_FIELD *fields, guint num_fields) {
+	guint i;
+	unsigned long wanted;
+
+	if (num_fields > sb->allocated) {
+		sb->bind= g_renew(MYSQL_BIND, sb->bind, num_fields);
+		sb->length= g_renew(unsigned long, sb->length, num_fields);
+		sb->is_null= g_renew(my_bool, sb->is_null, num_fields);
+		sb->error= g_renew(my_bool, sb->error, num_fields);
+		sb->buffer= g_renew(char *, sb->buffer, num_fields);
+		sb->buffer_size= g_renew(unsigned long, sb->buffer_size, num_fields);
+		sb->streamed= g_renew(guint8, sb->streamed, num_fields);
+		for (i= sb->allocated; i < num_fields; i++) {
+			sb->buffer[i]= NULL;
+			sb->buffer_size[i]= 0;
 		}
-		g_free(query);
-		return num_rows;
+		sb->allocated= num_fields;
+	}
+
+	memset(sb->bind, 0, sizeof(MYSQL_BIND) * num_fields);
+	memset(sb->streamed, 0, num_fields);
+	sb->num_streamed= 0;
+	for (i= 0; i < num_fields; i++) {
+		switch (fields[i].type) {
+			case MYSQL_TYPE_TINY:
+			case MYSQL_TYPE_SHORT:
+			case MYSQL_TYPE_INT24:
+			case MYSQL_TYPE_LONG:
+			case MYSQL_TYPE_LONGLONG:
+			case MYSQL_TYPE_YEAR:
+				sb->bind[i].buffer_type= MYSQL_TYPE_LONGLONG;
+				sb->bind[i].is_unsigned= (fields[i].flags & UNSIGNED_FLAG) ? 1 : 0;
+				wanted= sizeof(guint64);
+				break;
+			case MYSQL_TYPE_DATE:
+			case MYSQL_TYPE_DATETIME:
+			case MYSQL_TYPE_TIMESTAMP:
+			case MYSQL_TYPE_TIME:
+				sb->bind[i].buffer_type= fields[i].type;
+				wanted= sizeof(MYSQL_TIME);
+				break;
+			default:
+				/* Decimals, floats, strings and blobs come back as bytes, big values grow the buffer on fetch */
+				sb->bind[i].buffer_type= MYSQL_TYPE_STRING;
+				wanted= MIN(fields[i].length, FIELD_BUFFER_SIZE) + 1;
+				break;
+		}
+		if (sb->buffer_size[i] < wanted) {
+			g_free(sb->buffer[i]);
+			sb->buffer[i]= g_malloc(wanted);
+			sb->buffer_size[i]= wanted;
+		}
+		sb->bind[i].buffer= sb->buffer[i];
+		sb->bind[i].buffer_length= sb->buffer_size[i];
+		sb->bind[i].length= &sb->length[i];
+		sb->bind[i].is_null= &sb->is_null[i];
+		sb->bind[i].error= &sb->error[i];
 	}
+}
 
-	num_fields = mysql_num_fields(result);
-	MYSQL_FIELD *fields = mysql_fetch_fields(result);
+void free_stmt_buffers(struct stmt_buffers *sb) {
+	guint i;
 
-	/* Buffer for escaping field values */
-	GString *escaped = g_string_sized_new(3000);
+	for (i= 0; i < sb->allocated; i++)
+		g_free(sb->buffer[i]);
+	g_free(sb->bind);
+	g_free(sb->length);
+	g_free(sb->is_null);
+	g_free(sb->error);
+	g_free(sb->buffer);
+	g_free(sb->buffer_size);
+	g_free(sb->streamed);
+	g_free(sb->piece);
+	memset(sb, 0, sizeof(struct stmt_buffers));
+}
 
-	MYSQL_ROW row;
+/* Fetch next binary protocol row, columns that did not fit get a bigger buffer and are read again.
+   Values bigger than a statement are left where they are and marked to be streamed */
+int stmt_fetch_row(struct thread_data *td, MYSQL_STMT *stmt, struct stmt_buffers *sb, guint num_fields) {
+	guint i;
+	gboolean rebind= FALSE;
+	guint64 growth= 0;
+	int ret;
 
-	g_string_set_size(statement,0);
+	if (sb->num_streamed) {
+		memset(sb->streamed, 0, num_fields);
+		sb->num_streamed= 0;
+	}
+	ret= mysql_stmt_fetch(stmt);
+	if (ret != MYSQL_DATA_TRUNCATED)
+		return ret;
 
-	/* Poor man's data dump code */
-	while ((row = mysql_fetch_row(result))) {
-		gulong *lengths = mysql_fetch_lengths(result);
-		num_rows++;
+	for (i= 0; i < num_fields; i++) {
+		if (!sb->error[i] || sb->length[i] < sb->bind[i].buffer_length)
+			continue;
+		if (sb->length[i] > statement_size) {
+			sb->streamed[i]= 1;
+			sb->num_streamed++;
+		} else {
+			growth+= sb->length[i] + 1 - sb->buffer_size[i];
+		}
+	}
+	memory_reserve(td, &td->buffers_reserved, growth);
 
-		if (!statement->len){
-			if(!st_in_file){
-				if (detected_server == SERVER_TYPE_MYSQL) {
-					g_string_printf(statement,"/*!40101 SET NAMES binary*/;\n");
-					g_string_append(statement,"/*!40014 SET FOREIGN_KEY_CHECKS=0*/;\n");
-					if (!skip_tz) {
-					  g_string_append(statement,"/*!40103 SET TIME_ZONE='+00:00' */;\n");
-					}
-				} else {
-					g_string_printf(statement,"SET FOREIGN_KEY_CHECKS=0;\n");
-				}
+	for (i= 0; i < num_fields; i++) {
+		if (!sb->error[i] || sb->length[i] < sb->bind[i].buffer_length || sb->streamed[i])
+			continue;
+		g_free(sb->buffer[i]);
+		sb->buffer_size[i]= sb->length[i] + 1;
+		sb->buffer[i]= g_malloc(sb->buffer_size[i]);
+		sb->bind[i].buffer= sb->buffer[i];
+		sb->bind[i].buffer_length= sb->buffer_size[i];
+		if (mysql_stmt_fetch_column(stmt, &sb->bind[i], i, 0))
+			return 1;
+		rebind= TRUE;
+	}
+	if (rebind && mysql_stmt_bind_result(stmt, sb->bind))
+		return 1;
+
+	return 0;
+}
 
-				if (!write_data(file,statement)) {
-					g_critical("Could not write out data for %s.%s", database, table);
-					return num_rows;
-				}
-			}
-			g_string_printf(statement, "INSERT INTO `%s` VALUES", table);
-			num_rows_st = 0;
-		}
-		
-		if (statement_row->len) {
-			g_string_append(statement, statement_row->str);
-			g_string_set_size(statement_row,0);
-			num_rows_st++;
-		}
-		
-		g_string_append(statement_row, "\n(");
+/* Write value right aligned ending at end, returns where it starts */
+char *format_digits(char *end, guint64 value, guint width) {
+	char *p= end;
 
-		for (i = 0; i < num_fields; i++) {
-			/* Don't escape safe formats, saves some time */
-			if (!row[i]) {
-				g_string_append(statement_row, "NULL");
-			} else if (fields[i].flags & NUM_FLAG) {
-				g_string_append(statement_row, row[i]);
-			} else {
-				/* We reuse buffers for string escaping, growing is expensive just at the beginning */
-				g_string_set_size(escaped, lengths[i]*2+1);
-				mysql_real_escape_string(conn, escaped->str, row[i], lengths[i]);
-				g_string_append_c(statement_row,'\"');
-				g_string_append(statement_row,escaped->str);
-				g_string_append_c(statement_row,'\"');
-			}
-			if (i < num_fields - 1) {
-				g_string_append_c(statement_row,',');
-			} else {
-				g_string_append_c(statement_row,')');
-				/* INSERT statement is closed before over limit */
-				if(statement->len+statement_row->len+1 > statement_size) {
-					if(num_rows_st == 0){
-						g_string_append(statement, statement_row->str);
-						g_string_set_size(statement_row,0);
-						g_warning("Row bigger than statement_size for %s.%s", database, table);
-					}
-					g_string_append(statement,";\n");
+	do {
+		*--p= '0' + (value % 10);
+		value/= 10;
+	} while (value || (guint)(end - p) < width);
 
-					if (!write_data(file,statement)) {
-						g_critical("Could not write out data for %s.%s", database, table);
-						goto cleanup;
-					}else{
-						st_in_file++;
-						if(chunk_filesize && st_in_file*(guint)ceil((float)statement_size/1024/1024) > chunk_filesize){
-							fn++;
-							fcfile = g_strdup_printf("%s.%05d.sql%s", filename_prefix,fn,(compress_output?".gz":""));
-							if (output_filename==NULL){
-								if (!compress_output){
-									fclose((FILE *)file);
-									file = g_fopen(fcfile, "w");
-								} else {
-									gzclose((gzFile)file);
-									file = (void*) gzopen(fcfile, "w");
-								}
-		g_message("ACA10");
-							}else{
-								close_sync_data_statement(file);
-							}
-							st_in_file = 0;
-						}
-					}
-					g_string_set_size(statement,0);
-				} else {
-					if(num_rows_st)
-						g_string_append_c(statement,',');
-					g_string_append(statement, statement_row->str);
-					num_rows_st++;
-					g_string_set_size(statement_row,0);
-				}
-			}
+	return p;
+}
+
+/* Append an integer or temporal binary protocol value in the same text the server would have sent */
+void append_binary_value(GString *statement_row, MYSQL_BIND *bind, MYSQL_FIELD *field) {
+	char buffer[64];
+	char *end= buffer + sizeof(buffer);
+	char *p= end;
+	MYSQL_TIME *t;
+	gint64 value;
+
+	if (bind->buffer_type == MYSQL_TYPE_LONGLONG) {
+		value= *(gint64 *)bind->buffer;
+		if (bind->is_unsigned || value >= 0) {
+			p= format_digits(end, (guint64)value, 1);
+		} else {
+			p= format_digits(end, -(guint64)value, 1);
+			*--p= '-';
 		}
+		g_string_append_len(statement_row, p, end - p);
+		return;
 	}
-	if (mysql_errno(conn)) {
-		g_critical("Could not read data from %s.%s: %s", database, table, mysql_error(conn));
-		errors++;
+
+	t= (MYSQL_TIME *)bind->buffer;
+	*--p= '\"';
+	if (bind->buffer_type != MYSQL_TYPE_DATE && field->decimals > 0 && field->decimals <= 6) {
+		guint decimals= field->decimals;
+		guint64 fraction= t->second_part;
+		guint n;
+
+		for (n= decimals; n < 6; n++)
+			fraction/= 10;
+		p= format_digits(p, fraction, decimals);
+		*--p= '.';
+	}
+	if (bind->buffer_type != MYSQL_TYPE_DATE) {
+		p= format_digits(p, t->second, 2);
+		*--p= ':';
+		p= format_digits(p, t->minute, 2);
+		*--p= ':';
+		p= format_digits(p, t->hour, 2);
+	}
+	if (bind->buffer_type == MYSQL_TYPE_TIME) {
+		if (t->neg)
+			*--p= '-';
+	} else {
+		if (bind->buffer_type != MYSQL_TYPE_DATE)
+			*--p= ' ';
+		p= format_digits(p, t->day, 2);
+		*--p= '-';
+		p= format_digits(p, t->month, 2);
+		*--p= '-';
+		p= format_digits(p, t->year, 4);
+	}
+	*--p= '\"';
+	g_string_append_len(statement_row, p, end - p);
+}
+
+/* Whether a key value read back as text compares like the key orders. ENUM and SET sort by their index but
+   compare with a string as strings, FLOAT and DOUBLE are printed rounded. */
+static gboolean is_exact_key_field(MYSQL_FIELD *field) {
+	if (field->flags & (ENUM_FLAG | SET_FLAG))
+		return FALSE;
+	switch (field->type) {
+		case MYSQL_TYPE_ENUM:
+		case MYSQL_TYPE_SET:
+		case MYSQL_TYPE_FLOAT:
+		case MYSQL_TYPE_DOUBLE:
+			return FALSE;
+		default:
+			return TRUE;
 	}
-	
-	if (statement_row->len > 0) {
-		/* this last row has not been written out */
-		if (statement->len > 0) {
-			/* strange, should not happen */
-			g_string_append(statement, statement_row->str);
-		}
-		else {
-			g_string_printf(statement, "INSERT INTO `%s` VALUES", table);
-			g_string_append(statement, statement_row->str);
-		}
+}
+
+/* Strings up to this many bytes are cheap enough to size for the worst case escaping */
+#define SHORT_STRING_LENGTH 1024
+
+/* Byte strings, temporal and JSON values come with the binary character set too but aren't bytes */
+static gboolean is_binary_field(MYSQL_FIELD *field) {
+	if (field->charsetnr != 63)
+		return FALSE;
+	switch (field->type) {
+		case MYSQL_TYPE_STRING:
+		case MYSQL_TYPE_VAR_STRING:
+		case MYSQL_TYPE_VARCHAR:
+		case MYSQL_TYPE_TINY_BLOB:
+		case MYSQL_TYPE_BLOB:
+		case MYSQL_TYPE_MEDIUM_BLOB:
+		case MYSQL_TYPE_LONG_BLOB:
+		case MYSQL_TYPE_BIT:
+		case MYSQL_TYPE_GEOMETRY:
+			return TRUE;
+		default:
+			return FALSE;
 	}
+}
 
-	if (statement->len > 0) {
-		g_string_append(statement,";\n");
-		if (!write_data(file,statement)) {
-			g_critical("Could not write out closing newline for %s.%s, now this is sad!", database, table);
-			goto cleanup;
+/* Decide once per result set how every field gets written, and which row layout fast path applies */
+void prepare_row_encoder(struct row_encoder *re, MYSQL_FIELD *fields, guint num_fields, struct stmt_buffers *sb) {
+	guint i;
+	gboolean numeric= TRUE, short_strings= TRUE;
+
+	if (num_fields > re->allocated) {
+		re->kind= g_renew(guint8, re->kind, num_fields);
+		re->allocated= num_fields;
+	}
+	re->num_fields= num_fields;
+
+	for (i= 0; i < num_fields; i++) {
+		if (sb && sb->bind[i].buffer_type != MYSQL_TYPE_STRING) {
+			re->kind[i]= FIELD_TYPED;
+			numeric= short_strings= FALSE;
+		} else if (fields[i].flags & NUM_FLAG) {
+			/* Don't escape safe formats, saves some time */
+			re->kind[i]= FIELD_RAW;
+		} else {
+			re->kind[i]= (hex_blob && is_binary_field(&fields[i])) ? FIELD_HEX : FIELD_QUOTED;
+			numeric= FALSE;
+			if (fields[i].length > SHORT_STRING_LENGTH)
+				short_strings= FALSE;
 		}
-		st_in_file++;
 	}
 
-cleanup:
-	g_free(query);
+	/* Binary protocol rows keep their values in the bound buffers, they always go the generic way */
+	if (sb)
+		re->shape= ROW_GENERIC;
+	else if (numeric)
+		re->shape= ROW_NUMERIC;
+	else if (short_strings)
+		re->shape= ROW_NUMERIC_SHORT_STRING;
+	else
+		re->shape= ROW_GENERIC;
+}
 
-	g_string_free(escaped,TRUE);
-	g_string_free(statement,TRUE);
+void free_row_encoder(struct row_encoder *re) {
+	g_free(re->kind);
+	memset(re, 0, sizeof(struct row_encoder));
+}
 
-	if (result) {
-		mysql_free_result(result);
+/* Only numbers and NULLs, the row size is known up front so it is copied in without any growth checks */
+static void encode_row_numeric(struct row_encoder *re, GString *statement, MYSQL_ROW row, gulong *lengths) {
+	guint i;
+	gsize start= statement->len;
+	gsize size= re->num_fields + 2;
+	char *p;
+
+	for (i= 0; i < re->num_fields; i++)
+		size+= row[i] ? lengths[i] : 4;
+
+	g_string_set_size(statement, start + size);
+	p= statement->str + start;
+	*p++= '\n';
+	*p++= '(';
+	for (i= 0; i < re->num_fields; i++) {
+		if (i)
+			*p++= ',';
+		if (row[i]) {
+			memcpy(p, row[i], lengths[i]);
+			p+= lengths[i];
+		} else {
+			memcpy(p, "NULL", 4);
+			p+= 4;
+		}
 	}
+	*p= ')';
+}
 
-	close_file(file);
+/* 0x... takes two bytes per byte plus two, an empty value has no hex literal and is written as "" */
+static inline char *encode_hex(char *p, const char *value, gulong length) {
+	if (!length) {
+		memcpy(p, "\"\"", 2);
+		return p + 2;
+	}
+	memcpy(p, "0x", 2);
+	hex_string(p + 2, value, length);
+	return p + 2 + 2 * length;
+}
 
-	if (!st_in_file && !build_empty_files) {
-		// dropping the useless file
-		if (destination_type!=STDOUT && remove(fcfile)) {
- 			g_warning("Failed to remove empty file : %s\n", fcfile);
+/* Numbers and short strings, room for the worst case escaping is made once and the tail given back */
+static void encode_row_short_string(struct row_encoder *re, GString *statement, MYSQL_ROW row, gulong *lengths) {
+	guint i;
+	gsize start= statement->len;
+	gsize size= re->num_fields + 2;
+	char *p;
+
+	for (i= 0; i < re->num_fields; i++) {
+		if (!row[i])
+			size+= 4;
+		else if (re->kind[i] == FIELD_QUOTED || re->kind[i] == FIELD_HEX)
+			size+= 2 * lengths[i] + 2;
+		else
+			size+= lengths[i];
+	}
+
+	g_string_set_size(statement, start + size);
+	p= statement->str + start;
+	*p++= '\n';
+	*p++= '(';
+	for (i= 0; i < re->num_fields; i++) {
+		if (i)
+			*p++= ',';
+		if (!row[i]) {
+			memcpy(p, "NULL", 4);
+			p+= 4;
+		} else if (re->kind[i] == FIELD_QUOTED) {
+			*p++= '\"';
+			p+= escape_string(p, row[i], lengths[i]);
+			*p++= '\"';
+		} else if (re->kind[i] == FIELD_HEX) {
+			p= encode_hex(p, row[i], lengths[i]);
+		} else {
+			memcpy(p, row[i], lengths[i]);
+			p+= lengths[i];
 		}
-	}else if(chunk_filesize && fn == 1){
-		fcfile = g_strdup_printf("%s.sql%s", filename_prefix,(compress_output?".gz":""));
-		g_rename(filename, fcfile);
 	}
-	
-	g_free(filename_prefix);
-	g_free(fcfile);
-	
-	return num_rows;
+	*p++= ')';
+	g_string_truncate(statement, p - statement->str);
 }
 
-gboolean close_sync_data_statement(FILE* file) {
-        gboolean b=TRUE;
-	gpointer value = g_hash_table_lookup(output_filename_array,file);
-	GString *data=NULL;
-	if (value != NULL){
-		data=(GString *)value;
-	}else{
-		return FALSE;
+/* One value of a generic row, a NULL value is written as NULL */
+static void encode_field(struct row_encoder *re, GString *statement, guint i, char *value, gulong length, struct stmt_buffers *sb, MYSQL_FIELD *fields) {
+	if (!value) {
+		g_string_append_len(statement, "NULL", 4);
+		return;
 	}
-        g_async_queue_pop(write_queue);
-        FILE * outfile=NULL;
+	switch (re->kind[i]) {
+		case FIELD_TYPED:
+			/* Typed values are formatted straight from the bound buffer */
+			append_binary_value(statement, &sb->bind[i], &fields[i]);
+			break;
+		case FIELD_RAW:
+			g_string_append_len(statement, value, length);
+			break;
+		case FIELD_QUOTED:
+			/* Escaped straight into the row, clean spans are copied in bulk */
+			g_string_append_c(statement,'\"');
+			g_string_append_escaped(statement, value, length);
+			g_string_append_c(statement,'\"');
+			break;
+		case FIELD_HEX:
+			g_string_append_len(statement, length ? "0x" : "\"\"", 2);
+			g_string_append_hex(statement, value, length);
+			break;
+	}
+}
 
-	if (!compress_output){
-	        outfile= g_fopen(output_filename, "ab");
-	        b=real_write_data(outfile,data);
-	        fclose(outfile);
-	}else{
-	        outfile= (void*) gzopen(output_filename, "a");
-	        b=real_write_data(outfile,data);
-	        gzclose((gzFile)outfile);
+/* Appends "\n(...)" for the current row, sb is only set for binary protocol results */
+void encode_row(struct row_encoder *re, GString *statement, MYSQL_ROW row, gulong *lengths, struct stmt_buffers *sb, MYSQL_FIELD *fields) {
+	guint i;
+	char *value;
+
+	switch (re->shape) {
+		case ROW_NUMERIC:
+			encode_row_numeric(re, statement, row, lengths);
+			return;
+		case ROW_NUMERIC_SHORT_STRING:
+			encode_row_short_string(re, statement, row, lengths);
+			return;
+		case ROW_GENERIC:
+			break;
 	}
-        g_async_queue_push(write_queue,GINT_TO_POINTER(1));
-        return b;
+
+	g_string_append_len(statement, "\n(", 2);
+	for (i= 0; i < re->num_fields; i++) {
+		if (i)
+			g_string_append_c(statement,',');
+		value= sb ? (sb->is_null[i] ? NULL : sb->buffer[i]) : row[i];
+		encode_field(re, statement, i, value, lengths[i], sb, fields);
+	}
+	g_string_append_c(statement,')');
 }
 
-gboolean write_data(FILE* file,GString * data) {
-        if (output_filename==NULL){
-                return real_write_data(file,data);
-        }else{
-		gpointer value = g_hash_table_lookup(output_filename_array,file);
-		if (value != NULL){
-			GString * statement = (GString *)value;
-			g_string_append(statement,data->str);
-		}else{
-			g_hash_table_insert(output_filename_array,file,g_string_new (data->str));
+/* Values bigger than a statement are fetched in pieces of this size */
+#define FIELD_PIECE_SIZE (64 * 1024)
+
+/* Writes a binary protocol row that has streamed values as a statement of its own. What is built is written out
+   whenever it passes statement_size, so a streamed value is never in memory whole. Returns the statement buffer to
+   keep building into, empty, or NULL when fetching or writing failed */
+GString *stream_row(struct thread_data *td, MYSQL_STMT *stmt, MYSQL_FIELD *fields, void *file, GString *prefix) {
+	struct stmt_buffers *sb= &td->stmt_buffers;
+	struct row_encoder *re= &td->row_encoder;
+	GString *statement= td->statement;
+	MYSQL_BIND piece;
+	unsigned long length, offset;
+	my_bool is_null, error;
+	gsize n;
+	guint i;
+
+	if (!sb->piece)
+		sb->piece= g_malloc(FIELD_PIECE_SIZE);
+	memset(&piece, 0, sizeof(MYSQL_BIND));
+	piece.buffer_type= MYSQL_TYPE_STRING;
+	piece.buffer= sb->piece;
+	piece.buffer_length= FIELD_PIECE_SIZE;
+	piece.length= &length;
+	piece.is_null= &is_null;
+	piece.error= &error;
+
+	g_string_set_size(prefix, 0);
+	g_string_append_len(statement, "\n(", 2);
+	for (i= 0; i < re->num_fields; i++) {
+		if (i)
+			g_string_append_c(statement,',');
+		if (!sb->streamed[i]) {
+			encode_field(re, statement, i, sb->is_null[i] ? NULL : sb->buffer[i], sb->length[i], sb, fields);
+			continue;
+		}
+		if (re->kind[i] == FIELD_QUOTED)
+			g_string_append_c(statement,'\"');
+		else if (re->kind[i] == FIELD_HEX)
+			g_string_append_len(statement, "0x", 2);
+		for (offset= 0; offset < sb->length[i]; offset+= n) {
+			if (mysql_stmt_fetch_column(stmt, &piece, i, offset))
+				return NULL;
+			n= MIN(sb->length[i] - offset, FIELD_PIECE_SIZE);
+			if (re->kind[i] == FIELD_QUOTED)
+				g_string_append_escaped(statement, sb->piece, n);
+			else if (re->kind[i] == FIELD_HEX)
+				g_string_append_hex(statement, sb->piece, n);
+			else
+				g_string_append_len(statement, sb->piece, n);
+			/* Half a statement is just as good in the file, the rest follows */
+			if (statement->len > statement_size && !(statement= flush_statement(td, file, statement->len, prefix)))
+				return NULL;
 		}
+		if (re->kind[i] == FIELD_QUOTED)
+			g_string_append_c(statement,'\"');
 	}
-	return TRUE;
-}
+	g_string_append_len(statement, ");\n", 3);
 
+	return flush_statement(td, file, statement->len, prefix);
+}
 
-gboolean real_write_data(FILE* file,GString * data) {
-	size_t written= 0;
-	ssize_t r= 0;
+/* Runs the data query, with the binary protocol the result only has the metadata and the
+   statement's results are bound to the thread's buffers */
+gboolean open_data_result(MYSQL *conn, char *database, char *table, const char *partition, const char *where, const char *order, struct thread_data *td, MYSQL_STMT **stmtp, MYSQL_RES **resultp) {
+	struct stmt_buffers *sb = &td->stmt_buffers;
+	MYSQL_STMT *stmt = NULL;
+	MYSQL_RES *result = NULL;
+	char *query;
+	gchar **parts;
+	gchar *quoted = NULL;
 
-	while (written < data->len) {
-		if (destination_type==STDOUT){
-			printf("%s",data->str);
-			r=data->len;
+	/* Backticks in a partition name are doubled inside the quoted identifier */
+	if (partition) {
+		parts = g_strsplit(partition, "`", -1);
+		quoted = g_strjoinv("``", parts);
+		g_strfreev(parts);
+	}
+	/* Poor man's database code */
+ 	query = g_strdup_printf("SELECT %s * FROM `%s`.`%s` %s%s%s %s %s %s", (detected_server == SERVER_TYPE_MYSQL) ? "/*!40001 SQL_NO_CACHE */" : "", database, table, partition?"PARTITION (`":"",partition?quoted:"",partition?"`)":"", where?"WHERE":"",where?where:"",order?order:"");
+	g_free(quoted);
+	if (binary_protocol && detected_server == SERVER_TYPE_MYSQL) {
+		/* Binary protocol, result set gives us just the metadata */
+		if (!(stmt= mysql_stmt_init(conn))) {
+			g_critical("Error dumping table (%s.%s) data: %s ",database, table, mysql_error(conn));
+			errors++;
+			g_free(query);
+			return FALSE;
+		}
+		if (mysql_stmt_prepare(stmt, query, strlen(query)) || mysql_stmt_execute(stmt) || !(result=mysql_stmt_result_metadata(stmt))) {
+			if(success_on_1146 && mysql_stmt_errno(stmt) == 1146){
+				g_warning("Error dumping table (%s.%s) data: %s ",database, table, mysql_stmt_error(stmt));
+			}else{
+				g_critical("Error dumping table (%s.%s) data: %s ",database, table, mysql_stmt_error(stmt));
+				errors++;
+			}
+			mysql_stmt_close(stmt);
+			g_free(query);
+			return FALSE;
+		}
+	} else if (mysql_query(conn, query) || !(result=mysql_use_result(conn))) {
+		//ERROR 1146 
+		if(success_on_1146 && mysql_errno(conn) == 1146){
+			g_warning("Error dumping table (%s.%s) data: %s ",database, table, mysql_error(conn));
 		}else{
-			if (!compress_output)
-				r = write(fileno(file), data->str + written, data->len);
-			else
-				r = gzwrite((gzFile)file, data->str + written, data->len);
+			g_critical("Error dumping table (%s.%s) data: %s ",database, table, mysql_error(conn));
+			errors++;
 		}
-		if (r < 0) {
-			g_critical("Couldn't write data to a file: %s", strerror(errno));
+		g_free(query);
+		return FALSE;
+	}
+
+	if (stmt) {
+		prepare_stmt_buffers(sb, mysql_fetch_fields(result), mysql_num_fields(result));
+		if (mysql_stmt_bind_result(stmt, sb->bind)) {
+			g_critical("Error binding results for %s.%s: %s", database, table, mysql_stmt_error(stmt));
 			errors++;
+			mysql_free_result(result);
+			mysql_stmt_close(stmt);
+			g_free(query);
 			return FALSE;
 		}
-		written += r;
+	}
+	g_free(query);
+	*stmtp = stmt;
+	*resultp = result;
+	return TRUE;
+}
+
+/* Partitions of a table in partition order, subpartitions are read with their partition. NULL when it isn't partitioned. */
+GList *get_partitions(MYSQL *conn, char *database, char *table) {
+	GList *partitions = NULL;
+	MYSQL_RES *result;
+	MYSQL_ROW row;
+	gchar *query;
+	char *escaped_database, *escaped_table;
+
+	if (detected_server != SERVER_TYPE_MYSQL)
+		return NULL;
+	escaped_database = g_new(char, strlen(database)*2+1);
+	mysql_real_escape_string(conn, escaped_database, database, strlen(database));
+	escaped_table = g_new(char, strlen(table)*2+1);
+	mysql_real_escape_string(conn, escaped_table, table, strlen(table));
+	query = g_strdup_printf("SELECT PARTITION_NAME FROM information_schema.PARTITIONS WHERE TABLE_SCHEMA='%s' AND TABLE_NAME='%s' AND PARTITION_NAME IS NOT NULL GROUP BY PARTITION_NAME ORDER BY MIN(PARTITION_ORDINAL_POSITION)", escaped_database, escaped_table);
+	g_free(escaped_database);
+	g_free(escaped_table);
+	if (mysql_query(conn, query) || !(result = mysql_store_result(conn))) {
+		g_warning("Unable to list the partitions of %s.%s: %s", database, table, mysql_error(conn));
+		g_free(query);
+		return NULL;
+	}
+	g_free(query);
+	while ((row = mysql_fetch_row(result)))
+		partitions = g_list_append(partitions, g_strdup(row[0]));
+	mysql_free_result(result);
+	return partitions;
+}
+
+/* Primary key columns of a table in key order, NULL when it has none */
+gchar **get_primary_key(MYSQL *conn, char *database, char *table) {
+	gchar *query = g_strdup_printf("SHOW INDEX FROM `%s`.`%s`", database, table);
+	MYSQL_RES *indexes;
+	MYSQL_ROW row;
+	GString *columns = NULL;
+
+	if (mysql_query(conn, query) || !(indexes = mysql_store_result(conn))) {
+		g_warning("Unable to list the keys of %s.%s, reading it in one query: %s", database, table, mysql_error(conn));
+		g_free(query);
+		return NULL;
+	}
+	g_free(query);
+	while ((row = mysql_fetch_row(indexes))) {
+		if (strcmp(row[2], "PRIMARY"))
+			continue;
+		if (!columns)
+			columns = g_string_new(row[4]);
+		else
+			g_string_append_printf(columns, "\t%s", row[4]);
+	}
+	mysql_free_result(indexes);
+	return columns ? g_strsplit(g_string_free(columns, FALSE), "\t", 0) : NULL;
+}
+
+/* Sets up the source for the first query of a data job, paging when asked and the table has a primary key */
+gboolean start_data_source(MYSQL *conn, char *database, char *table, struct data_source *src, struct thread_data *td, MYSQL_STMT **stmt, MYSQL_RES **result) {
+	GString *key;
+	MYSQL_FIELD *fields;
+	guint i, k, num_fields;
+
+	/* An empty range still needs a result for the file to be written */
+	if (src->range && !(src->slice = take_key_slice(src->range)))
+		src->slice = g_strdup("FALSE");
+	if (page_rows && (src->key_columns = get_primary_key(conn, database, table))) {
+		key = g_string_sized_new(64);
+		for (k = 0; src->key_columns[k]; k++)
+			g_string_append_printf(key, "%s`%s`", k ? "," : "", src->key_columns[k]);
+		src->page_key = g_string_free(key, FALSE);
+		src->key_index = g_new0(guint, k);
+		src->last_key = g_string_sized_new(64);
+	}
+	if (!open_data_source(conn, database, table, src, td, stmt, result))
+		return FALSE;
+	if (src->page_key) {
+		fields = mysql_fetch_fields(*result);
+		num_fields = mysql_num_fields(*result);
+		for (k = 0; src->key_columns[k]; k++)
+			for (i = 0; i < num_fields; i++)
+				if (!g_ascii_strcasecmp(fields[i].name, src->key_columns[k]))
+					src->key_index[k] = i;
+		/* The next page is found by comparing with the key as text, which only works if it orders the same way */
+		for (k = 0; src->key_columns[k] && is_exact_key_field(&fields[src->key_index[k]]); k++);
+		if (src->key_columns[k]) {
+			g_message("Not paging %s.%s, `%s` can't be compared in key order", database, table, src->key_columns[k]);
+			mysql_free_result(*result);
+			*result = NULL;
+			if (*stmt) {
+				mysql_stmt_close(*stmt);
+				*stmt = NULL;
+			}
+			g_free(src->page_key);
+			src->page_key = NULL;
+			if (!open_data_source(conn, database, table, src, td, stmt, result))
+				return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+/* Runs the query for the current slice, or the page after the last row read */
+gboolean open_data_source(MYSQL *conn, char *database, char *table, struct data_source *src, struct thread_data *td, MYSQL_STMT **stmt, MYSQL_RES **result) {
+	char *base = src->slice ? src->slice : src->where;
+	GString *where = g_string_sized_new(256);
+	gchar *order = NULL;
+	gboolean opened;
+
+	if (base)
+		g_string_append_printf(where, "(%s)", base);
+	if (src->page_key) {
+		if (src->last_key->len)
+			g_string_append_printf(where, "%s(%s) > %s", base ? " AND " : "", src->page_key, src->last_key->str);
+		order = g_strdup_printf("ORDER BY %s LIMIT %u", src->page_key, page_rows);
+		src->page_read = 0;
+	}
+	opened = open_data_result(conn, database, table, src->partition, where->len ? where->str : NULL, order, td, stmt, result);
+	g_string_free(where, TRUE);
+	g_free(order);
+	return opened;
+}
+
+/* Moves on to the next page or the next slice once a result is read to the end, FALSE when there is none */
+gboolean next_data_result(MYSQL *conn, char *database, char *table, struct data_source *src, struct thread_data *td, MYSQL_STMT **stmt, MYSQL_RES **result, MYSQL_FIELD **fields) {
+	mysql_free_result(*result);
+	*result = NULL;
+	if (*stmt) {
+		mysql_stmt_close(*stmt);
+		*stmt = NULL;
+	}
+	/* A short page was the last one of the slice */
+	if (!src->page_key || src->page_read < page_rows) {
+		if (!src->range)
+			return FALSE;
+		g_free(src->slice);
+		if (!(src->slice = take_key_slice(src->range)))
+			return FALSE;
+		if (src->page_key)
+			g_string_truncate(src->last_key, 0);
+	}
+	if (!open_data_source(conn, database, table, src, td, stmt, result))
+		return FALSE;
+	*fields = mysql_fetch_fields(*result);
+	prepare_row_encoder(&td->row_encoder, *fields, mysql_num_fields(*result), *stmt ? &td->stmt_buffers : NULL);
+	return TRUE;
+}
+
+/* Keeps the primary key of the row just read as a row constructor, the next page starts after it.
+   It goes to the source server, so values are written like get_key_boundaries() does, whatever its sql_mode */
+void remember_page_key(MYSQL *conn, struct data_source *src, MYSQL_ROW row, gulong *lengths, struct stmt_buffers *sb, MYSQL_FIELD *fields) {
+	guint k, i;
+	gsize start;
+	char *value, *escaped;
+
+	g_string_truncate(src->last_key, 0);
+	g_string_append_c(src->last_key, '(');
+	for (k = 0; src->key_columns[k]; k++) {
+		i = src->key_index[k];
+		if (k)
+			g_string_append_c(src->last_key, ',');
+		value = sb ? (sb->is_null[i] ? NULL : sb->buffer[i]) : row[i];
+		if (!value) {
+			g_string_append(src->last_key, "NULL");
+		} else if (sb && sb->bind[i].buffer_type != MYSQL_TYPE_STRING) {
+			/* Temporal values are written in double quotes and hold nothing that needs escaping */
+			start = src->last_key->len;
+			append_binary_value(src->last_key, &sb->bind[i], &fields[i]);
+			if (sb->bind[i].buffer_type != MYSQL_TYPE_LONGLONG)
+				src->last_key->str[start] = src->last_key->str[src->last_key->len - 1] = '\'';
+		} else if (fields[i].flags & NUM_FLAG) {
+			g_string_append_len(src->last_key, value, lengths[i]);
+		} else if (is_binary_field(&fields[i])) {
+			g_string_append(src->last_key, "X'");
+			g_string_append_hex(src->last_key, value, lengths[i]);
+			g_string_append_c(src->last_key, '\'');
+		} else {
+			escaped = g_new(char, lengths[i]*2+1);
+			mysql_real_escape_string(conn, escaped, value, lengths[i]);
+			g_string_append_printf(src->last_key, "'%s'", escaped);
+			g_free(escaped);
+		}
+	}
+	g_string_append_c(src->last_key, ')');
+	src->page_read++;
+}
+
+void free_data_source(struct data_source *src) {
+	g_free(src->slice);
+	g_strfreev(src->key_columns);
+	g_free(src->page_key);
+	g_free(src->key_index);
+	if (src->last_key)
+		g_string_free(src->last_key, TRUE);
+}
+
+/* Do actual data chunk reading/writing magic */
+guint64 dump_table_data(MYSQL * conn, FILE *file, char *database, char *table, char *where, char *partition, char *filename, struct thread_data *td, struct key_range_chunk *range)
+{
+	guint fn = 1;
+	guint st_in_file = 0;
+	guint num_fields = 0;
+	guint64 num_rows = 0;
+	guint64 num_rows_st = 0;
+	MYSQL_RES *result = NULL;
+	MYSQL_STMT *stmt = NULL;
+	struct stmt_buffers *sb = &td->stmt_buffers;
+	gchar *fcfile = NULL;
+	gchar* filename_prefix = NULL;
+	
+	fcfile = g_strdup (filename);
+	
+	if(chunk_filesize){
+		gchar** split_filename= g_strsplit(filename, ".00001.sql", 0);
+		filename_prefix= split_filename[0];
+		g_free(split_filename);
+	}
+
+	
+	/* Statement buffer belongs to the thread, it keeps its allocation from table to table */
+	if (!td->statement)
+		td->statement = g_string_sized_new(statement_size);
+	GString* statement = td->statement;
+	
+	/* A key range is read a slice at a time and primary keys can be read a page at a time, the first query now */
+	struct data_source src;
+	memset(&src, 0, sizeof(struct data_source));
+	src.where = where;
+	src.partition = partition;
+	src.range = range;
+	if (!start_data_source(conn, database, table, &src, td, &stmt, &result)) {
+		free_data_source(&src);
+		return num_rows;
+	}
+
+	num_fields = mysql_num_fields(result);
+	MYSQL_FIELD *fields = mysql_fetch_fields(result);
+
+	prepare_row_encoder(&td->row_encoder, fields, num_fields, stmt ? sb : NULL);
+
+	MYSQL_ROW row = NULL;
+	gulong *lengths = NULL;
+	int ret;
+	gsize row_start = 0;
+	gsize flushed = 0;
+	/* Statement bytes already handed to the current file */
+	guint64 file_bytes = 0;
+	gboolean rotate = FALSE;
+	GString *prefix = g_string_sized_new(256);
+	/* Only chunk files share a dictionary */
+	struct table_dict *tdict = (table_dicts && (where || partition || range || chunk_filesize)) ? get_table_dict(filename) : NULL;
+	/* The first statement tells whether the table's data is worth compressing */
+	gboolean probed = !tuner;
+	gboolean store = FALSE;
+
+	if (tdict)
+		set_data_file_dict(file, tdict);
+	gchar *insert_header = g_strdup_printf("INSERT INTO `%s` VALUES", table);
+	gsize insert_header_len = strlen(insert_header);
+
+	g_string_set_size(statement,0);
+
+	/* Poor man's data dump code */
+	for (;;) {
+		if (stmt) {
+			ret = stmt_fetch_row(td, stmt, sb, num_fields);
+			if (ret == MYSQL_NO_DATA) {
+				if (next_data_result(conn, database, table, &src, td, &stmt, &result, &fields))
+					continue;
+				break;
+			}
+			if (ret) {
+				g_critical("Could not read data from %s.%s: %s", database, table, mysql_stmt_error(stmt));
+				errors++;
+				break;
+			}
+			lengths = sb->length;
+		} else {
+			if (!(row = mysql_fetch_row(result))) {
+				if (!mysql_errno(conn) && next_data_result(conn, database, table, &src, td, &stmt, &result, &fields))
+					continue;
+				break;
+			}
+			lengths = mysql_fetch_lengths(result);
+		}
+		num_rows++;
+		if (src.page_key)
+			remember_page_key(conn, &src, row, lengths, stmt ? sb : NULL, fields);
+
+		if (stmt && sb->num_streamed) {
+			/* The statement built so far is closed, the row goes out in one of its own */
+			if (num_rows_st) {
+				g_string_append_len(statement, ";\n", 2);
+				g_string_set_size(prefix,0);
+				if (!(statement = flush_statement(td, file, statement->len, prefix))) {
+					g_critical("Could not write out data for %s.%s", database, table);
+					goto cleanup;
+				}
+				st_in_file++;
+			}
+			if (!st_in_file)
+				append_data_header(statement);
+			g_string_append_len(statement, insert_header, insert_header_len);
+			if (!(statement = stream_row(td, stmt, fields, file, prefix))) {
+				g_critical("Could not write out data for %s.%s: %s", database, table, mysql_stmt_error(stmt));
+				errors++;
+				goto cleanup;
+			}
+			st_in_file++;
+			num_rows_st = 0;
+			if ((td->reserved || td->buffers_reserved) && !(statement = release_row_memory(td, stmt, sb, num_fields))) {
+				g_critical("Could not rebind results for %s.%s: %s", database, table, mysql_stmt_error(stmt));
+				errors++;
+				goto cleanup;
+			}
+			continue;
+		}
+
+		if (!statement->len){
+			if (!st_in_file)
+				append_data_header(statement);
+			g_string_append_len(statement, insert_header, insert_header_len);
+			num_rows_st = 0;
+		}
+
+		if (budget)
+			reserve_statement_growth(td, statement, lengths, num_fields);
+
+		/* Row goes straight into its final place in the statement */
+		row_start = statement->len;
+		if (num_rows_st)
+			g_string_append_c(statement,',');
+		encode_row(&td->row_encoder, statement, row, lengths, stmt ? sb : NULL, fields);
+		num_rows_st++;
+
+		/* INSERT statement is closed before over limit */
+		if (statement->len + 2 > statement_size) {
+			if (num_rows_st == 1) {
+				g_warning("Row bigger than statement_size for %s.%s", database, table);
+				g_string_append_len(statement, ";\n", 2);
+				flushed = statement->len;
+			} else {
+				/* Roll the row back, the ",\n" in front of it becomes the ";\n" closing the statement */
+				statement->str[row_start] = ';';
+				flushed = row_start + 2;
+			}
+
+			st_in_file++;
+			rotate = chunk_filesize && data_file_size(file, file_bytes, flushed) >= (guint64)chunk_filesize*1024*1024;
+			file_bytes += flushed;
+			if (tdict)
+				add_dict_samples(tdict, statement->str, flushed);
+			if (!probed) {
+				probed = TRUE;
+				if ((store = incompressible(statement->str, flushed))) {
+					g_message("Data of %s.%s doesn't compress, storing it", database, table);
+					set_data_file_store(file);
+				}
+			}
+
+			/* The rolled back row starts the next statement, in a new file after the session settings */
+			g_string_set_size(prefix,0);
+			if (flushed < statement->len) {
+				if (rotate)
+					append_data_header(prefix);
+				g_string_append_len(prefix, insert_header, insert_header_len);
+				g_string_append_c(prefix,'\n');
+			}
+			if (!(statement = flush_statement(td, file, flushed, prefix))) {
+				g_critical("Could not write out data for %s.%s", database, table);
+				goto cleanup;
+			}
+			num_rows_st = statement->len ? 1 : 0;
+			/* Once the big row is written out its buffers go back to their usual size */
+			if ((td->reserved || td->buffers_reserved) && statement->len < statement_size && !(statement = release_row_memory(td, stmt, sb, num_fields))) {
+				g_critical("Could not rebind results for %s.%s: %s", database, table, mysql_stmt_error(stmt));
+				errors++;
+				goto cleanup;
+			}
+
+			if (rotate) {
+				fn++;
+				g_free(fcfile);
+				fcfile = g_strdup_printf("%s.%05d.sql%s", filename_prefix,fn,codec_extension(output_codec));
+				if (output_filename==NULL){
+					if (writer_pool) {
+						/* The writer closes it once the queued statements are out */
+						close_data_file(file, FALSE);
+						file = open_data_file_async(fcfile);
+					} else {
+						close_file(file);
+						file = open_file(fcfile);
+					}
+					if (tdict) {
+						table_dict_chunk_done(tdict, FALSE);
+						set_data_file_dict(file, tdict);
+					}
+					if (store)
+						set_data_file_store(file);
+				}else{
+					close_sync_data_statement(file);
+				}
+				st_in_file = 0;
+				file_bytes = 0;
+			}
+		}
+	}
+	if (!stmt && result && mysql_errno(conn)) {
+		g_critical("Could not read data from %s.%s: %s", database, table, mysql_error(conn));
+		errors++;
+	}
+
+	if (statement->len > 0) {
+		g_string_append_len(statement, ";\n", 2);
+		if (tdict)
+			add_dict_samples(tdict, statement->str, statement->len);
+		if (!probed && incompressible(statement->str, statement->len)) {
+			g_message("Data of %s.%s doesn't compress, storing it", database, table);
+			set_data_file_store(file);
+		}
+		g_string_set_size(prefix,0);
+		if (!(statement = flush_statement(td, file, statement->len, prefix))) {
+			g_critical("Could not write out closing newline for %s.%s, now this is sad!", database, table);
+			goto cleanup;
+		}
+		st_in_file++;
+	}
+
+cleanup:
+	g_free(insert_header);
+	free_data_source(&src);
+	g_string_free(prefix,TRUE);
+	g_string_set_size(td->statement,0);
+	if (td->reserved || td->buffers_reserved)
+		release_row_memory(td, NULL, sb, num_fields);
+
+	if (result) {
+		mysql_free_result(result);
+	}
+	if (stmt) {
+		mysql_stmt_close(stmt);
+	}
+
+	if (writer_pool)
+		close_data_file(file, TRUE);
+	else
+		close_file(file);
+	if (tdict)
+		table_dict_chunk_done(tdict, TRUE);
+
+	if (!st_in_file && !build_empty_files) {
+		// dropping the useless file
+		if (destination_type!=STDOUT && remove(fcfile)) {
+ 			g_warning("Failed to remove empty file : %s\n", fcfile);
+		}
+	}else if(chunk_filesize && fn == 1){
+		fcfile = g_strdup_printf("%s.sql%s", filename_prefix,codec_extension(output_codec));
+		g_rename(filename, fcfile);
+	}
+	
+	g_free(filename_prefix);
+	g_free(fcfile);
+	
+	return num_rows;
+}
+
+/* Encodes the rows of a single scan a batch at a time into a data file of its own, a batch with no rows ends it */
+void *scan_encoder_thread(struct scan_encoder *se) {
+	struct thread_data *td= &se->td;
+	struct scan_batch *batch;
+	MYSQL_ROW row= g_new(char *, se->num_fields);
+	gulong *lengths= g_new(gulong, se->num_fields);
+	GString *statement= td->statement;
+	GString *prefix= g_string_sized_new(256);
+	gchar *insert_header= g_strdup_printf("INSERT INTO `%s` VALUES", se->table);
+	gsize insert_header_len= strlen(insert_header);
+	guint64 num_rows_st= 0;
+	gsize row_start, flushed;
+	void *file;
+	char *data;
+	guint i, r;
+
+	file= writer_pool ? open_data_file(se->filename) : open_file(se->filename);
+	if (!file) {
+		g_critical("Error: DB: %s TABLE: %s Could not create output file %s (%d)", se->database, se->table, se->filename, errno);
+		errors++;
+		se->failed= TRUE;
+	}
+	prepare_row_encoder(&td->row_encoder, se->fields, se->num_fields, NULL);
+
+	for (;;) {
+		batch= g_async_queue_pop(se->batches);
+		if (!batch->rows) {
+			g_async_queue_push(se->free_batches, batch);
+			break;
+		}
+		/* After a failure batches are still taken, the scan must not wait for this thread */
+		data= batch->data->str;
+		for (r= 0; r < batch->rows && !se->failed; r++) {
+			for (i= 0; i < se->num_fields; i++) {
+				lengths[i]= g_array_index(batch->lengths, gulong, r * se->num_fields + i);
+				if (lengths[i] == G_MAXULONG) {
+					row[i]= NULL;
+					lengths[i]= 0;
+				} else {
+					row[i]= data;
+					data+= lengths[i] + 1;
+				}
+			}
+
+			if (!statement->len) {
+				if (!se->statements)
+					append_data_header(statement);
+				g_string_append_len(statement, insert_header, insert_header_len);
+				num_rows_st= 0;
+			}
+			if (budget)
+				reserve_statement_growth(td, statement, lengths, se->num_fields);
+
+			row_start= statement->len;
+			if (num_rows_st)
+				g_string_append_c(statement,',');
+			encode_row(&td->row_encoder, statement, row, lengths, NULL, se->fields);
+			num_rows_st++;
+			se->rows++;
+
+			if (statement->len + 2 > statement_size) {
+				if (num_rows_st == 1) {
+					g_warning("Row bigger than statement_size for %s.%s", se->database, se->table);
+					g_string_append_len(statement, ";\n", 2);
+					flushed= statement->len;
+				} else {
+					/* Roll the row back, the ",\n" in front of it becomes the ";\n" closing the statement */
+					statement->str[row_start]= ';';
+					flushed= row_start + 2;
+				}
+				se->statements++;
+				g_string_set_size(prefix,0);
+				if (flushed < statement->len) {
+					g_string_append_len(prefix, insert_header, insert_header_len);
+					g_string_append_c(prefix,'\n');
+				}
+				if (!(statement= flush_statement(td, file, flushed, prefix))) {
+					g_critical("Could not write out data for %s.%s", se->database, se->table);
+					se->failed= TRUE;
+					break;
+				}
+				num_rows_st= statement->len ? 1 : 0;
+				if ((td->reserved || td->buffers_reserved) && statement->len < statement_size)
+					statement= release_row_memory(td, NULL, &td->stmt_buffers, 0);
+			}
+		}
+		g_async_queue_push(se->free_batches, batch);
+	}
+
+	if (!se->failed && statement->len > 0) {
+		g_string_append_len(statement, ";\n", 2);
+		g_string_set_size(prefix,0);
+		if (flush_statement(td, file, statement->len, prefix))
+			se->statements++;
+		else
+			g_critical("Could not write out closing newline for %s.%s, now this is sad!", se->database, se->table);
+	}
+
+	if (file) {
+		if (writer_pool)
+			close_data_file(file, TRUE);
+		else
+			close_file(file);
+		if (!se->statements && !build_empty_files && remove(se->filename))
+			g_warning("Failed to remove empty file : %s\n", se->filename);
+	}
+	if (td->reserved || td->buffers_reserved)
+		release_row_memory(td, NULL, &td->stmt_buffers, 0);
+	free_row_encoder(&td->row_encoder);
+	g_string_free(td->statement, TRUE);
+	td->statement= NULL;
+	g_free(insert_header);
+	g_string_free(prefix, TRUE);
+	g_free(lengths);
+	g_free(row);
+	return NULL;
+}
+
+/* Reads a table in one scan and hands its rows to scan_files threads, each writing a data file of its own.
+   Tables that can't be chunked are read by one connection but formatted and compressed in parallel. */
+guint64 dump_table_scan(MYSQL *conn, char *database, char *table, char *prefix, guint scan_files, struct thread_data *td) {
+	struct scan_encoder *encoders;
+	struct scan_batch *batch;
+	GAsyncQueue *batches, *free_batches;
+	MYSQL_RES *result= NULL;
+	MYSQL_FIELD *fields;
+	MYSQL_ROW row;
+	gulong *lengths;
+	gulong len;
+	guint num_fields, i, n;
+	guint64 num_rows= 0;
+	gchar *query;
+
+	/* Text protocol, the rows are copied out as they are */
+	query= g_strdup_printf("SELECT %s * FROM `%s`.`%s`", (detected_server == SERVER_TYPE_MYSQL) ? "/*!40001 SQL_NO_CACHE */" : "", database, table);
+	if (mysql_query(conn, query) || !(result= mysql_use_result(conn))) {
+		if(success_on_1146 && mysql_errno(conn) == 1146){
+			g_warning("Error dumping table (%s.%s) data: %s ",database, table, mysql_error(conn));
+		}else{
+			g_critical("Error dumping table (%s.%s) data: %s ",database, table, mysql_error(conn));
+			errors++;
+		}
+		g_free(query);
+		return 0;
+	}
+	g_free(query);
+	num_fields= mysql_num_fields(result);
+	fields= mysql_fetch_fields(result);
+
+	/* Two batches per thread, the scan waits when the threads fall behind */
+	batches= g_async_queue_new();
+	free_batches= g_async_queue_new();
+	for (n= 0; n < 2 * scan_files; n++) {
+		batch= g_new0(struct scan_batch, 1);
+		batch->data= g_string_sized_new(statement_size);
+		batch->lengths= g_array_new(FALSE, FALSE, sizeof(gulong));
+		g_async_queue_push(free_batches, batch);
+	}
+	/* Statement buffers of the threads and the batches */
+	memory_account((gint64)scan_files * 4 * statement_size);
+
+	encoders= g_new0(struct scan_encoder, scan_files);
+	for (n= 0; n < scan_files; n++) {
+		struct scan_encoder *se= &encoders[n];
+		se->td.conf= td->conf;
+		se->td.thread_id= td->thread_id;
+		se->td.statement= g_string_sized_new(statement_size);
+		se->batches= batches;
+		se->free_batches= free_batches;
+		se->database= database;
+		se->table= table;
+		se->filename= g_strdup_printf("%s.%05d.sql%s", prefix, n, codec_extension(output_codec));
+		se->fields= fields;
+		se->num_fields= num_fields;
+		se->thread= g_thread_create((GThreadFunc)scan_encoder_thread, se, TRUE, NULL);
+	}
+
+	batch= NULL;
+	while ((row= mysql_fetch_row(result))) {
+		lengths= mysql_fetch_lengths(result);
+		if (!batch) {
+			batch= g_async_queue_pop(free_batches);
+			g_string_set_size(batch->data, 0);
+			g_array_set_size(batch->lengths, 0);
+			batch->rows= 0;
+		}
+		for (i= 0; i < num_fields; i++) {
+			len= row[i] ? lengths[i] : G_MAXULONG;
+			g_array_append_val(batch->lengths, len);
+			if (row[i]) {
+				g_string_append_len(batch->data, row[i], lengths[i]);
+				g_string_append_c(batch->data, '\0');
+			}
+		}
+		batch->rows++;
+		num_rows++;
+		/* About a statement worth of rows goes to a thread at a time */
+		if (batch->data->len >= statement_size) {
+			g_async_queue_push(batches, batch);
+			batch= NULL;
+		}
+	}
+	if (mysql_errno(conn)) {
+		g_critical("Could not read data from %s.%s: %s", database, table, mysql_error(conn));
+		errors++;
+	}
+	if (batch)
+		g_async_queue_push(batches, batch);
+	for (n= 0; n < scan_files; n++) {
+		batch= g_async_queue_pop(free_batches);
+		batch->rows= 0;
+		g_async_queue_push(batches, batch);
+	}
+
+	for (n= 0; n < scan_files; n++) {
+		g_thread_join(encoders[n].thread);
+		g_free(encoders[n].filename);
+	}
+	mysql_free_result(result);
+	while ((batch= g_async_queue_try_pop(free_batches))) {
+		g_string_free(batch->data, TRUE);
+		g_array_free(batch->lengths, TRUE);
+		g_free(batch);
+	}
+	g_async_queue_unref(free_batches);
+	g_async_queue_unref(batches);
+	memory_account(-(gint64)scan_files * 4 * statement_size);
+	g_free(encoders);
+
+	if (!num_rows)
+		g_message("Empty table %s.%s", database, table);
+	return num_rows;
+}
+
+gboolean close_sync_data_statement(FILE* file) {
+        gboolean b=TRUE;
+	struct sync_data *sd;
+
+	g_mutex_lock(output_filename_mutex);
+	sd= g_hash_table_lookup(output_filename_array,file);
+	g_hash_table_remove(output_filename_array,file);
+	g_mutex_unlock(output_filename_mutex);
+	if (!sd)
+		return FALSE;
+        g_async_queue_pop(write_queue);
+	/* Appending starts a new gzip member or zstd frame, readers see one stream */
+	struct codec_file *outfile= codec_open(output_filename, "a", output_codec, compress_level, compress_threads);
+	if (outfile) {
+		if (sd->spill) {
+			b=copy_spill_file(sd, outfile);
+		}else{
+			b=real_write_data((FILE *)outfile,sd->data);
+		}
+	        codec_close(outfile);
+	}else{
+		g_critical("Couldn't open %s: %s", output_filename, strerror(errno));
+		errors++;
+		b=FALSE;
+	}
+        g_async_queue_push(write_queue,GINT_TO_POINTER(1));
+	if (sd->spill) {
+		fclose(sd->spill);
+		remove(sd->spill_name);
+		g_free(sd->spill_name);
+	}
+	memory_account(-(gint64)sd->data->allocated_len);
+	g_string_free(sd->data, TRUE);
+	g_free(sd);
+        return b;
+}
+
+/* The spill file is read back in pieces the size of a statement */
+gboolean copy_spill_file(struct sync_data *sd, struct codec_file *outfile) {
+	gsize len;
+
+	rewind(sd->spill);
+	g_string_set_size(sd->data, statement_size);
+	while ((len= fread(sd->data->str, 1, statement_size, sd->spill))) {
+		g_string_set_size(sd->data, len);
+		if (!real_write_data((FILE *)outfile, sd->data))
+			return FALSE;
+		g_string_set_size(sd->data, statement_size);
+	}
+	if (ferror(sd->spill)) {
+		g_critical("Couldn't read %s: %s", sd->spill_name, strerror(errno));
+		errors++;
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/* What was kept of the table so far moves to a file next to the output */
+gboolean spill_sync_data(struct sync_data *sd, FILE *file) {
+	sd->spill_name= g_strdup_printf("%s.%p.spill", output_filename, (void *)file);
+	if (!(sd->spill= g_fopen(sd->spill_name, "w+"))) {
+		g_critical("Couldn't create %s: %s", sd->spill_name, strerror(errno));
+		errors++;
+		return FALSE;
+	}
+	if (sd->data->len && fwrite(sd->data->str, 1, sd->data->len, sd->spill) != sd->data->len) {
+		g_critical("Couldn't write to %s: %s", sd->spill_name, strerror(errno));
+		errors++;
+		return FALSE;
+	}
+	memory_account(-(gint64)sd->data->allocated_len);
+	g_string_free(sd->data, TRUE);
+	sd->data= g_string_new("");
+	memory_account(sd->data->allocated_len);
+	return TRUE;
+}
+
+gboolean write_data(FILE* file,GString * data) {
+        if (output_filename==NULL){
+                return real_write_data(file,data);
+        }else{
+		struct sync_data *sd;
+		gsize allocated;
+
+		/* Each file is only written by the thread dumping it, the lock is for the table of them */
+		g_mutex_lock(output_filename_mutex);
+		sd= g_hash_table_lookup(output_filename_array,file);
+		if (!sd) {
+			sd= g_new0(struct sync_data, 1);
+			sd->data= g_string_new("");
+			memory_account(sd->data->allocated_len);
+			g_hash_table_insert(output_filename_array,file,sd);
+		}
+		g_mutex_unlock(output_filename_mutex);
+		if (!sd->spill && memory_exceeded(data->len) && !spill_sync_data(sd, file))
+			return FALSE;
+		if (sd->spill) {
+			if (fwrite(data->str, 1, data->len, sd->spill) != data->len) {
+				g_critical("Couldn't write to %s: %s", sd->spill_name, strerror(errno));
+				errors++;
+				return FALSE;
+			}
+			return TRUE;
+		}
+		allocated= sd->data->allocated_len;
+		g_string_append_len(sd->data,data->str,data->len);
+		memory_account((gint64)sd->data->allocated_len - (gint64)allocated);
+	}
+	return TRUE;
+}
+
+/* Writes the first len bytes of data, whatever follows stays in the buffer */
+gboolean write_data_prefix(FILE* file,GString * data, gsize len) {
+	gsize full= data->len;
+	gboolean b;
+
+	data->len= len;
+	b= write_data(file,data);
+	data->len= full;
+
+	return b;
+}
+
+/* Session settings at the top of every data file */
+void append_data_header(GString *statement) {
+	if (detected_server == SERVER_TYPE_MYSQL) {
+		g_string_append(statement,"/*!40101 SET NAMES binary*/;\n");
+		g_string_append(statement,"/*!40014 SET FOREIGN_KEY_CHECKS=0*/;\n");
+		if (!skip_tz) {
+		  g_string_append(statement,"/*!40103 SET TIME_ZONE='+00:00' */;\n");
+		}
+	} else {
+		g_string_append(statement,"SET FOREIGN_KEY_CHECKS=0;\n");
+	}
+}
+
+/* Writes out the first flushed bytes of the thread's statement buffer. What follows them is the start of
+   the next statement, it is put behind prefix and the buffer to keep building into is returned */
+GString *flush_statement(struct thread_data *td, void *file, gsize flushed, GString *prefix) {
+	GString *statement= td->statement;
+	gsize row_len= statement->len - flushed;
+
+	if (writer_pool) {
+		/* Swap buffers, the full one goes to the writer and is recycled once written */
+		GString *next= g_async_queue_pop(writer_pool->free_buffers);
+		guint64 handed= 0;
+		g_string_append_len(next, prefix->str, prefix->len);
+		g_string_append_len(next, statement->str + flushed, row_len);
+		g_string_truncate(statement, flushed);
+		/* What a big row grew the buffer by is given back by the writer, the column buffers' part stays with the thread */
+		if (td->reserved && statement->allocated_len > 2 * (gsize)statement_size) {
+			handed= MIN(td->reserved, statement->allocated_len - 2 * (gsize)statement_size);
+			td->reserved-= handed;
+		}
+		queue_write(file, statement, handed);
+		td->statement= next;
+		return next;
+	}
+
+	if (!write_data_prefix(file, statement, flushed))
+		return NULL;
+	if (prefix->len > flushed)
+		g_string_set_size(statement, prefix->len + row_len);
+	memmove(statement->str + prefix->len, statement->str + flushed, row_len);
+	memcpy(statement->str, prefix->str, prefix->len);
+	g_string_set_size(statement, prefix->len + row_len);
+
+	return statement;
+}
+
+/* Opens a data file that is written by the writer threads, with --compress every statement
+   becomes its own gzip member or zstd frame so they can be compressed in parallel and just concatenated */
+void *open_data_file(char *filename) {
+	struct writer_file *wf;
+	FILE *file= g_fopen(filename, "w");
+
+	if (!file)
+		return NULL;
+	wf= g_new0(struct writer_file, 1);
+	wf->file= file;
+	wf->mutex= g_mutex_new();
+	wf->cond= g_cond_new();
+	return wf;
+}
+
+static void queue_writer_job(struct writer_file *wf, enum write_job_type type, GString *data, GAsyncQueue *done, guint64 reserved);
+
+/* How big a data file gets once pending more statement bytes are in it. Compressed
+   files count what is on disk and estimate the rest from the ratio seen so far. */
+guint64 data_file_size(void *file, guint64 flushed, gsize pending) {
+	struct writer_file *wf;
+	guint64 in= 0, out= 0, queued= 0;
+
+	/* Neither -f nor stdout output is compressed per file, statement bytes are file bytes */
+	if (output_filename || !file)
+		return flushed + pending;
+	if (writer_pool) {
+		wf= (struct writer_file *)file;
+		g_mutex_lock(wf->mutex);
+		in= wf->written_in;
+		out= wf->bytes;
+		g_mutex_unlock(wf->mutex);
+		queued= wf->queued_in - in;
+	} else {
+		codec_totals((struct codec_file *)file, &in, &out);
+	}
+	if (!in || !out)
+		return out + queued + pending;
+	return out + (guint64)((gdouble)(queued + pending) * out / in);
+}
+
+/* Rotation opens the next file on a writer thread, it is created in order before anything queued for it */
+void *open_data_file_async(char *filename) {
+	struct writer_file *wf= g_new0(struct writer_file, 1);
+
+	wf->filename= g_strdup(filename);
+	wf->mutex= g_mutex_new();
+	wf->cond= g_cond_new();
+	queue_writer_job(wf, WRITE_OPEN, NULL, NULL, 0);
+	return wf;
+}
+
+static void queue_writer_job(struct writer_file *wf, enum write_job_type type, GString *data, GAsyncQueue *done, guint64 reserved) {
+	struct write_job *wj= g_new0(struct write_job, 1);
+
+	/* Only the dumping thread that owns the file queues for it, no lock needed here */
+	wj->type= type;
+	wj->file= wf;
+	wj->data= data;
+	wj->done= done;
+	wj->reserved= reserved;
+	wj->seq= wf->queued++;
+	wj->level= wf->store ? codec_store_level(output_codec) : (tuner ? compress_tuner_level() : compress_level);
+	g_async_queue_push(writer_pool->queue, wj);
+}
+
+void queue_write(void *file, GString *data, guint64 reserved) {
+	((struct writer_file *)file)->queued_in+= data->len;
+	queue_writer_job((struct writer_file *)file, WRITE_DATA, data, NULL, reserved);
+}
+
+/* Closes a file after everything queued for it is written, waits for that when asked to */
+void close_data_file(void *file, gboolean wait) {
+	GAsyncQueue *done= wait ? g_async_queue_new() : NULL;
+
+	queue_writer_job((struct writer_file *)file, WRITE_CLOSE, NULL, done, 0);
+	if (done) {
+		g_async_queue_pop(done);
+		g_async_queue_unref(done);
+	}
+}
+
+/* Jobs are taken in queue order, so the job a writer waits for has always been taken by another writer already */
+static void wait_turn(struct writer_file *wf, guint64 seq) {
+	g_mutex_lock(wf->mutex);
+	while (wf->written != seq)
+		g_cond_wait(wf->cond, wf->mutex);
+	g_mutex_unlock(wf->mutex);
+}
+
+static void end_turn(struct writer_file *wf, gsize in_len, gsize out_len) {
+	g_mutex_lock(wf->mutex);
+	wf->written++;
+	wf->written_in+= in_len;
+	wf->bytes+= out_len;
+	g_cond_broadcast(wf->cond);
+	g_mutex_unlock(wf->mutex);
+}
+
+/* The tuner times writes against compression, without syncing now and then a write is only a copy into the page cache */
+static void sync_data_file(struct writer_file *wf, gsize len) {
+	if ((wf->unsynced+= len) < TUNE_SYNC_BYTES)
+		return;
+	if (fdatasync(fileno(wf->file))) {
+		g_critical("Couldn't sync %s: %s", wf->filename, strerror(errno));
+		errors++;
+	}
+	wf->unsynced= 0;
+}
+
+static gboolean write_file_data(FILE *file, const char *data, gsize len) {
+	gsize written= 0;
+	ssize_t r;
+
+	while (written < len) {
+		r= write(fileno(file), data + written, len - written);
+		if (r < 0) {
+			g_critical("Couldn't write data to a file: %s", strerror(errno));
+			errors++;
+			return FALSE;
+		}
+		written+= r;
+	}
+	return TRUE;
+}
+
+/* Buffers a big row grew go back to the free list at their usual size */
+static void recycle_buffer(struct write_job *wj) {
+	if (wj->data->allocated_len > 2 * (gsize)statement_size) {
+		g_string_free(wj->data, TRUE);
+		wj->data= g_string_sized_new(statement_size);
+	} else {
+		g_string_set_size(wj->data, 0);
+	}
+	g_async_queue_push(writer_pool->free_buffers, wj->data);
+	memory_release(wj->reserved);
+}
+
+void *writer_thread(GAsyncQueue *queue) {
+	struct write_job *wj;
+	struct writer_file *wf;
+	struct codec_block *cb= NULL;
+	GString *compressed= NULL;
+	const char *out;
+	gsize out_len, wj_len;
+	int level= compress_level;
+	GTimer *timer= g_timer_new();
+	struct codec_stats stats;
+
+	if (compress_output) {
+		if (!(cb= codec_block_new(output_codec, compress_level))) {
+			g_critical("Couldn't initialize compression for writer thread");
+			exit(EXIT_FAILURE);
+		}
+		compressed= g_string_sized_new(statement_size);
+	}
+
+	for (;;) {
+		wj= (struct write_job *)g_async_queue_pop(queue);
+		wf= (struct writer_file *)wj->file;
+		wj_len= wj->data ? wj->data->len : 0;
+		switch (wj->type) {
+			case WRITE_OPEN:
+				wait_turn(wf, wj->seq);
+				if (!(wf->file= g_fopen(wf->filename, "w"))) {
+					g_critical("Could not create output file %s (%d)", wf->filename, errno);
+					errors++;
+				}
+				end_turn(wf, 0, 0);
+				break;
+			case WRITE_DATA:
+				/* Compression runs in parallel, only the write itself waits for the previous statements */
+				if (compress_output) {
+					if (wj->level != level) {
+						if (!codec_block_set_level(cb, wj->level)) {
+							g_critical("Couldn't change the compression level to %d", wj->level);
+							errors++;
+						}
+						level= wj->level;
+					}
+					memset(&stats, 0, sizeof(struct codec_stats));
+					stats.in_bytes= wj->data->len;
+					g_timer_start(timer);
+					if (codec_block_compress(cb, compressed, wj->data->str, wj->data->len, wf->dict)) {
+						out= compressed->str;
+						out_len= compressed->len;
+					} else {
+						errors++;
+						out= NULL;
+						out_len= 0;
+					}
+					stats.compress_seconds= g_timer_elapsed(timer, NULL);
+					recycle_buffer(wj);
+					wait_turn(wf, wj->seq);
+					g_timer_start(timer);
+					if (out && wf->file && write_file_data(wf->file, out, out_len) && tuner)
+						sync_data_file(wf, out_len);
+					stats.io_seconds= g_timer_elapsed(timer, NULL);
+					stats.out_bytes= out_len;
+					if (compressed->allocated_len > 2 * (gsize)statement_size) {
+						g_string_free(compressed, TRUE);
+						compressed= g_string_sized_new(statement_size);
+					}
+					/* Stored files don't say anything about the level */
+					if (tuner && !wf->store)
+						tune_compression(&stats);
+				} else {
+					out_len= wj->data->len;
+					wait_turn(wf, wj->seq);
+					if (wf->file)
+						write_file_data(wf->file, wj->data->str, out_len);
+					recycle_buffer(wj);
+				}
+				end_turn(wf, wj_len, out_len);
+				break;
+			case WRITE_CLOSE:
+				wait_turn(wf, wj->seq);
+				/* A compressed file with no statements still has to be a valid compressed file */
+				if (wf->file) {
+					if (compress_output && !wf->bytes && codec_block_compress(cb, compressed, "", 0, NULL))
+						write_file_data(wf->file, compressed->str, compressed->len);
+					fclose(wf->file);
+				}
+				g_free(wf->filename);
+				g_mutex_free(wf->mutex);
+				g_cond_free(wf->cond);
+				g_free(wf);
+				if (wj->done)
+					g_async_queue_push(wj->done, GINT_TO_POINTER(1));
+				break;
+			case WRITE_SHUTDOWN:
+				g_free(wj);
+				g_timer_destroy(timer);
+				if (compress_output) {
+					codec_block_free(cb);
+					g_string_free(compressed, TRUE);
+				}
+				return NULL;
+		}
+		g_free(wj);
+	}
+	return NULL;
+}
+
+void start_writers(void) {
+	guint n;
+
+	writer_pool= g_new0(struct writer_pool, 1);
+	writer_pool->num_writers= writer_threads;
+	writer_pool->queue= g_async_queue_new();
+	writer_pool->threads= g_new(GThread *, writer_threads);
+	/* Each fetch thread can have two statements waiting before it blocks */
+	writer_pool->num_buffers= 2 * num_threads * (less_locking + 1);
+	writer_pool->free_buffers= g_async_queue_new();
+	for (n= 0; n < writer_pool->num_buffers; n++)
+		g_async_queue_push(writer_pool->free_buffers, g_string_sized_new(statement_size));
+	for (n= 0; n < writer_threads; n++)
+		writer_pool->threads[n]= g_thread_create((GThreadFunc)writer_thread, writer_pool->queue, TRUE, NULL);
+}
+
+void stop_writers(void) {
+	guint n;
+	GString *buffer;
+
+	for (n= 0; n < writer_pool->num_writers; n++) {
+		struct write_job *wj= g_new0(struct write_job, 1);
+		wj->type= WRITE_SHUTDOWN;
+		g_async_queue_push(writer_pool->queue, wj);
+	}
+	for (n= 0; n < writer_pool->num_writers; n++)
+		g_thread_join(writer_pool->threads[n]);
+	g_async_queue_unref(writer_pool->queue);
+	while ((buffer= g_async_queue_try_pop(writer_pool->free_buffers)))
+		g_string_free(buffer, TRUE);
+	g_async_queue_unref(writer_pool->free_buffers);
+	g_free(writer_pool->threads);
+	g_free(writer_pool);
+	writer_pool= NULL;
+}
+
+/* Samples are cut into pieces of this size, the trainer wants many small samples */
+#define DICT_SAMPLE_SIZE 16384
+#define DICT_SAMPLE_BYTES (8 * 1024 * 1024)
+#define DICT_SAMPLE_CHUNKS 8
+
+struct table_dict *get_table_dict(char *filename) {
+	gchar *dict_filename= codec_dict_filename(filename);
+	struct table_dict *d;
+
+	g_mutex_lock(table_dicts_mutex);
+	d= g_hash_table_lookup(table_dicts, dict_filename);
+	if (!d) {
+		d= g_new0(struct table_dict, 1);
+		d->mutex= g_mutex_new();
+		d->samples= g_string_sized_new(DICT_SAMPLE_SIZE);
+		d->sizes= g_array_new(FALSE, FALSE, sizeof(gsize));
+		d->filename= dict_filename;
+		g_hash_table_insert(table_dicts, d->filename, d);
+		memory_account(d->samples->allocated_len);
+	} else {
+		g_free(dict_filename);
+	}
+	g_mutex_unlock(table_dicts_mutex);
+
+	return d;
+}
+
+/* Called with the number of data jobs of a table before they are queued, filename is any of their files */
+void set_table_dict_jobs(char *filename, guint jobs) {
+	struct table_dict *d;
+
+	if (!table_dicts)
+		return;
+	d= get_table_dict(filename);
+	g_mutex_lock(d->mutex);
+	d->jobs= jobs;
+	g_mutex_unlock(d->mutex);
+}
+
+static void free_dict_samples(struct table_dict *d) {
+	memory_account(-(gint64)d->samples->allocated_len);
+	g_string_free(d->samples, TRUE);
+	g_array_free(d->sizes, TRUE);
+	d->samples= NULL;
+	d->sizes= NULL;
+}
+
+void free_table_dict(struct table_dict *d) {
+	g_mutex_free(d->mutex);
+	if (d->samples)
+		free_dict_samples(d);
+	codec_dict_free(d->dict);
+	g_free(d->filename);
+	g_free(d);
+}
+
+/* Keeps pieces of a written statement until there is enough to train on */
+void add_dict_samples(struct table_dict *d, const char *data, gsize len) {
+	gsize size, allocated;
+
+	g_mutex_lock(d->mutex);
+	if (!d->done) {
+		allocated= d->samples->allocated_len;
+		while (len && d->samples->len < DICT_SAMPLE_BYTES) {
+			size= MIN(len, DICT_SAMPLE_SIZE);
+			g_string_append_len(d->samples, data, size);
+			g_array_append_val(d->sizes, size);
+			data+= size;
+			len-= size;
+		}
+		memory_account((gint64)d->samples->allocated_len - (gint64)allocated);
+	}
+	g_mutex_unlock(d->mutex);
+}
+
+/* Once enough chunks are sampled the dictionary is trained and stored next to the table's files,
+   chunks opened from then on are compressed with it. Tables with few jobs train after half of them,
+   once the last one is done no file is left to use a dictionary and the samples are dropped.
+   Files of stolen key ranges aren't counted, by then all the table's files are open. */
+void table_dict_chunk_done(struct table_dict *d, gboolean last) {
+	gboolean train= FALSE, drop= FALSE;
+	struct codec_dict *dict;
+
+	g_mutex_lock(d->mutex);
+	d->chunks++;
+	if (last)
+		d->jobs_done++;
+	if (!d->done && d->jobs && d->jobs_done >= d->jobs) {
+		d->done= TRUE;
+		drop= TRUE;
+	} else if (!d->done && (d->chunks >= DICT_SAMPLE_CHUNKS || d->samples->len >= DICT_SAMPLE_BYTES || (d->jobs && d->jobs_done >= (d->jobs + 1) / 2))) {
+		d->done= TRUE;
+		train= TRUE;
+	}
+	g_mutex_unlock(d->mutex);
+	if (drop)
+		free_dict_samples(d);
+	if (!train)
+		return;
+
+	/* Nobody touches the samples once done is set */
+	dict= codec_dict_train(d->samples->str, (gsize *)d->sizes->data, d->sizes->len, compress_level);
+	free_dict_samples(d);
+	if (dict && !codec_dict_save(dict, d->filename)) {
+		errors++;
+		codec_dict_free(dict);
+		dict= NULL;
+	}
+	g_mutex_lock(d->mutex);
+	d->dict= dict;
+	g_mutex_unlock(d->mutex);
+}
+
+void set_data_file_dict(void *file, struct table_dict *d) {
+	struct codec_dict *dict;
+
+	g_mutex_lock(d->mutex);
+	dict= d->dict;
+	g_mutex_unlock(d->mutex);
+	if (!dict)
+		return;
+	if (writer_pool)
+		((struct writer_file *)file)->dict= dict;
+	else
+		codec_set_dict((struct codec_file *)file, dict);
+}
+
+/* Every window of data the level moves a step towards whichever of compressing or writing took longer,
+   one has to take a quarter longer than the other */
+#define TUNE_WINDOW (64 * 1024 * 1024)
+#define TUNE_MARGIN 1.25
+/* Incompressible data is recognized by compressing the start of a data file at the fastest level */
+#define PROBE_SIZE (256 * 1024)
+#define PROBE_MIN_SIZE 4096
+#define PROBE_RATIO 0.9
+
+void start_compress_tuner(void) {
+	tuner= g_new0(struct compress_tuner, 1);
+	tuner->mutex= g_mutex_new();
+	codec_level_range(output_codec, &tuner->fastest, &tuner->level, &tuner->best);
+	if (compress_level >= 0)
+		tuner->level= CLAMP(compress_level, tuner->fastest, tuner->best);
+}
+
+void tune_compression(struct codec_stats *stats) {
+	int level;
+
+	g_mutex_lock(tuner->mutex);
+	tuner->in_bytes+= stats->in_bytes;
+	tuner->compress_seconds+= stats->compress_seconds;
+	tuner->io_seconds+= stats->io_seconds;
+	if (tuner->in_bytes >= TUNE_WINDOW) {
+		level= tuner->level;
+		if (tuner->compress_seconds > tuner->io_seconds * TUNE_MARGIN && level > tuner->fastest)
+			level--;
+		else if (tuner->io_seconds > tuner->compress_seconds * TUNE_MARGIN && level < tuner->best)
+			level++;
+		if (level != tuner->level)
+			g_message("Compression level %d, compressing took %.2fs and writing %.2fs", level, tuner->compress_seconds, tuner->io_seconds);
+		tuner->level= level;
+		tuner->in_bytes= 0;
+		tuner->compress_seconds= tuner->io_seconds= 0;
+	}
+	g_mutex_unlock(tuner->mutex);
+}
+
+int compress_tuner_level(void) {
+	int level;
+
+	g_mutex_lock(tuner->mutex);
+	level= tuner->level;
+	g_mutex_unlock(tuner->mutex);
+
+	return level;
+}
+
+/* Files written at the store level keep it */
+void adapt_file_level(struct codec_file *cf) {
+	struct codec_stats stats;
+	int level;
+
+	if (codec_get_level(cf) == codec_store_level(output_codec))
+		return;
+	codec_take_stats(cf, &stats);
+	tune_compression(&stats);
+	level= compress_tuner_level();
+	if (level != codec_get_level(cf) && !codec_set_level(cf, level)) {
+		g_critical("Couldn't change the compression level to %d: %s", level, codec_error(cf));
+		errors++;
+	}
+}
+
+gboolean incompressible(const char *data, gsize len) {
+	int fastest, start, best;
+	struct codec_block *cb;
+	GString *out;
+	gboolean r= FALSE;
+
+	if (len < PROBE_MIN_SIZE)
+		return FALSE;
+	codec_level_range(output_codec, &fastest, &start, &best);
+	if (!(cb= codec_block_new(output_codec, fastest)))
+		return FALSE;
+	len= MIN(len, PROBE_SIZE);
+	out= g_string_sized_new(len);
+	if (codec_block_compress(cb, out, data, len, NULL))
+		r= out->len > len * PROBE_RATIO;
+	g_string_free(out, TRUE);
+	codec_block_free(cb);
+
+	return r;
+}
+
+/* Called before anything is written to the file */
+void set_data_file_store(void *file) {
+	if (writer_pool) {
+		((struct writer_file *)file)->store= TRUE;
+	} else if (!codec_set_level((struct codec_file *)file, codec_store_level(output_codec))) {
+		g_critical("Couldn't change the compression level: %s", codec_error((struct codec_file *)file));
+		errors++;
+	}
+}
+
+void start_memory_budget(guint64 baseline) {
+	budget= g_new0(struct memory_budget, 1);
+	budget->mutex= g_mutex_new();
+	budget->cond= g_cond_new();
+	budget->limit= (guint64)memory_limit * 1024 * 1024;
+	budget->used= budget->peak= baseline;
+	if (baseline >= budget->limit)
+		g_warning("--memory-limit %u MB is less than the %" G_GUINT64_FORMAT " MB the statement buffers take, big rows will be dumped one at a time", memory_limit, baseline / 1024 / 1024);
+}
+
+/* Memory that is never waited for, like -f tables kept until they are done */
+void memory_account(gint64 bytes) {
+	if (!budget)
+		return;
+	g_mutex_lock(budget->mutex);
+	budget->used+= bytes;
+	if (budget->used > budget->peak)
+		budget->peak= budget->used;
+	g_mutex_unlock(budget->mutex);
+	if (bytes < 0)
+		g_cond_broadcast(budget->cond);
+}
+
+gboolean memory_exceeded(guint64 bytes) {
+	gboolean r;
+
+	if (!budget)
+		return FALSE;
+	g_mutex_lock(budget->mutex);
+	r= budget->used + bytes > budget->limit;
+	g_mutex_unlock(budget->mutex);
+
+	return r;
+}
+
+/* Threads wait only while holding no reservation themselves and for reservations held by others, those are held
+   by threads that never wait here and always get to give them back. held is counted even without a budget,
+   it is how much the buffers grew past their usual size */
+void memory_reserve(struct thread_data *td, guint64 *held, guint64 bytes) {
+	if (!bytes)
+		return;
+	if (budget) {
+		g_mutex_lock(budget->mutex);
+		while (!td->reserved && !td->buffers_reserved && budget->reserved && budget->used + bytes > budget->limit)
+			g_cond_wait(budget->cond, budget->mutex);
+		budget->used+= bytes;
+		budget->reserved+= bytes;
+		if (budget->used > budget->peak)
+			budget->peak= budget->used;
+		g_mutex_unlock(budget->mutex);
+	}
+	*held+= bytes;
+}
+
+void memory_release(guint64 bytes) {
+	if (!budget || !bytes)
+		return;
+	g_mutex_lock(budget->mutex);
+	budget->used-= bytes;
+	budget->reserved-= bytes;
+	g_cond_broadcast(budget->cond);
+	g_mutex_unlock(budget->mutex);
+}
+
+/* Escaping can double a value, what that takes past the statement buffer's usual size is reserved */
+void reserve_statement_growth(struct thread_data *td, GString *statement, gulong *lengths, guint num_fields) {
+	guint64 need= statement->len + 4;
+	guint64 have= MAX(statement->allocated_len, 2 * (guint64)statement_size);
+	guint i;
+
+	for (i= 0; i < num_fields; i++)
+		need+= 2 * (guint64)lengths[i] + 4;
+	if (need > have)
+		memory_reserve(td, &td->reserved, need - have);
+}
+
+/* Shrinks what a big row grew and gives the reservations back, the statement's and the column buffers'.
+   stmt is NULL once the result is done, returns the statement buffer to keep building into or NULL when
+   the result couldn't be rebound */
+GString *release_row_memory(struct thread_data *td, MYSQL_STMT *stmt, struct stmt_buffers *sb, guint num_fields) {
+	GString *statement= td->statement;
+	gboolean rebind= FALSE;
+	guint i;
+
+	if (statement->allocated_len > 2 * (gsize)statement_size) {
+		statement= g_string_sized_new(statement_size);
+		g_string_append_len(statement, td->statement->str, td->statement->len);
+		g_string_free(td->statement, TRUE);
+		td->statement= statement;
+	}
+	for (i= 0; i < sb->allocated; i++) {
+		if (sb->buffer_size[i] <= FIELD_BUFFER_SIZE + 1)
+			continue;
+		g_free(sb->buffer[i]);
+		sb->buffer_size[i]= FIELD_BUFFER_SIZE + 1;
+		sb->buffer[i]= g_malloc(sb->buffer_size[i]);
+		if (stmt && i < num_fields) {
+			sb->bind[i].buffer= sb->buffer[i];
+			sb->bind[i].buffer_length= sb->buffer_size[i];
+			rebind= TRUE;
+		}
+	}
+	memory_release(td->reserved + td->buffers_reserved);
+	td->reserved= 0;
+	td->buffers_reserved= 0;
+	if (rebind && mysql_stmt_bind_result(stmt, sb->bind))
+		return NULL;
+
+	return statement;
+}
+
+
+gboolean real_write_data(FILE* file,GString * data) {
+	if (destination_type==STDOUT){
+		if (fwrite(data->str, 1, data->len, stdout) != data->len) {
+			g_critical("Couldn't write data to stdout: %s", strerror(errno));
+			errors++;
+			return FALSE;
+		}
+	}else if (!codec_write((struct codec_file *)file, data->str, data->len)) {
+		g_critical("Couldn't write data to a file: %s", codec_error((struct codec_file *)file));
+		errors++;
+		return FALSE;
+	}else if (tuner) {
+		adapt_file_level((struct codec_file *)file);
 	}
 
 	return TRUE;
@@ -23,7 +23,7 @@
 #define _mydumper_h
 enum destination_type { FOLDER, SPEC_FILE, STDOUT };
 
-enum job_type { JOB_SHUTDOWN, JOB_RESTORE, JOB_DUMP, JOB_DUMP_NON_INNODB, JOB_SCHEMA, JOB_VIEW, JOB_TRIGGERS, JOB_SCHEMA_POST, JOB_BINLOG, JOB_LOCK_DUMP_NON_INNODB };
+enum job_type { JOB_SHUTDOWN, JOB_RESTORE, JOB_DUMP, JOB_DUMP_NON_INNODB, JOB_SCHEMA, JOB_VIEW, JOB_TRIGGERS, JOB_SCHEMA_POST, JOB_BINLOG, JOB_LOCK_DUMP_NON_INNODB, JOB_PLAN, JOB_DISCOVER };
 
 struct configuration {
 	char use_any_index;
@@ -36,9 +36,125 @@ struct configuration {
 	int done;
 };
 
+/* Result buffers for the binary protocol fetch path, reused by a thread across tables */
+struct stmt_buffers {
+	MYSQL_BIND *bind;
+	unsigned long *length;
+	my_bool *is_null;
+	my_bool *error;
+	char **buffer;
+	unsigned long *buffer_size;
+	guint allocated;
+	/* Values too big for a statement are left in the row and read piece by piece into piece */
+	guint8 *streamed;
+	guint num_streamed;
+	char *piece;
+};
+
+/* How a row is laid out, decided once per result set from the field metadata */
+enum row_shape { ROW_GENERIC, ROW_NUMERIC, ROW_NUMERIC_SHORT_STRING };
+
+enum field_kind { FIELD_QUOTED, FIELD_RAW, FIELD_TYPED, FIELD_HEX };
+
+/* Per result set encoding plan, reused by a thread across tables */
+struct row_encoder {
+	enum row_shape shape;
+	guint8 *kind;
+	guint num_fields;
+	guint allocated;
+};
+
 struct thread_data {
         struct configuration *conf;
         guint thread_id;
+        struct stmt_buffers stmt_buffers;
+        struct row_encoder row_encoder;
+        GString *statement;
+        /* Memory reserved for the statement buffer and for the column buffers of big rows */
+        guint64 reserved;
+        guint64 buffers_reserved;
+};
+
+enum write_job_type { WRITE_OPEN, WRITE_DATA, WRITE_CLOSE, WRITE_SHUTDOWN };
+
+/* Work for a writer thread, data buffers go back to the free list once written */
+struct write_job {
+	enum write_job_type type;
+	void *file;
+	GString *data;
+	GAsyncQueue *done;
+	guint64 seq;
+	int level;
+	guint64 reserved;
+};
+
+/* A data file fed through the writer threads, jobs are committed in the order they were queued */
+struct writer_file {
+	FILE *file;
+	gchar *filename;
+	struct codec_dict *dict;
+	gboolean store;
+	GMutex *mutex;
+	GCond *cond;
+	guint64 queued;
+	guint64 written;
+	/* Statement bytes queued and written, and what they took in the file */
+	guint64 queued_in;
+	guint64 written_in;
+	guint64 bytes;
+	/* Bytes written since the file was last flushed to the disk, with --adaptive-compression */
+	guint64 unsynced;
+};
+
+/* Memory held for statements by all threads. Every statement buffer may use twice statement_size, rows that need
+   more reserve it first, with --memory-limit they wait until other threads give theirs back */
+struct memory_budget {
+	GMutex *mutex;
+	GCond *cond;
+	guint64 limit;
+	guint64 used;
+	guint64 reserved;
+	guint64 peak;
+};
+
+/* -f: the statements of a table are kept until the table is done, past the memory limit they go to a spill file */
+struct sync_data {
+	GString *data;
+	gchar *spill_name;
+	FILE *spill;
+};
+
+/* Compression level shared by everything writing data files, adapted to whether compressing or writing is slower */
+struct compress_tuner {
+	GMutex *mutex;
+	int level;
+	int fastest;
+	int best;
+	guint64 in_bytes;
+	gdouble compress_seconds;
+	gdouble io_seconds;
+};
+
+/* Compression dictionary shared by the chunk files of a table, trained from samples of the first chunks */
+struct table_dict {
+	GMutex *mutex;
+	GString *samples;
+	GArray *sizes;
+	guint chunks;
+	/* Data jobs planned for the table and those finished, 0 planned when unknown */
+	guint jobs;
+	guint jobs_done;
+	gboolean done;
+	struct codec_dict *dict;
+	gchar *filename;
+};
+
+struct writer_pool {
+	guint num_writers;
+	GAsyncQueue *queue;
+	GThread **threads;
+	GAsyncQueue *free_buffers;
+	guint num_buffers;
 };
 
 struct job {
@@ -52,6 +168,80 @@ struct table_job {
 	char *table;
 	char *filename;
 	char *where;
+	char *partition;
+	struct key_range_chunk *range;
+	/* Read in one scan and written by this many threads, filename is then the prefix of their files */
+	guint scan_files;	/* Chunk of the table's plan, counting from 1, 0 when it isn't one */
+	guint chunk;
+};
+
+/* Where a data job reads from: one query, the slices of a key range, pages of the primary key or slices in pages */
+struct data_source {
+	char *where;
+	char *partition;
+	struct key_range_chunk *range;
+	gchar *slice;
+	/* Paging: primary key columns, their place in the result and the key of the last row read */
+	gchar **key_columns;
+	gchar *page_key;
+	guint *key_index;
+	GString *last_key;
+	guint64 page_read;
+};
+
+/* Data files of a table's key ranges, stolen ranges take the next chunk number */
+struct key_range_table {
+	gchar *prefix;
+	guint chunks;
+	guint refs;
+};
+
+/* Integer key range of a chunk. It is read in slices and a thread with nothing left
+   to do can take over the half that hasn't been read yet. Guarded by key_ranges_mutex. */
+struct key_range_chunk {
+	char *database;
+	char *table;
+	char *filename;
+	char *field;
+	gint64 next;
+	gint64 to;
+	gint64 slice;
+	/* The first range also has NULLs and anything below, the last anything above */
+	gboolean first;
+	gboolean last;
+	/* Estimated rows per key value */
+	gdouble density;
+	struct key_range_table *owner;
+};
+
+/* Rows copied out of a result for an encoding thread, values are NUL terminated and NULLs have length G_MAXULONG */
+struct scan_batch {
+	GString *data;
+	GArray *lengths;
+	guint rows;
+};
+
+/* A thread encoding the rows of a single scan into a data file of its own */
+struct scan_encoder {
+	struct thread_data td;
+	GThread *thread;
+	GAsyncQueue *batches;
+	GAsyncQueue *free_batches;
+	char *database;
+	char *table;
+	gchar *filename;
+	MYSQL_FIELD *fields;
+	guint num_fields;
+	guint64 rows;
+	guint statements;
+	gboolean failed;
+};
+
+/* Tables of a group of databases listed by a thread, handed back through done */
+struct discovery_job {
+	gchar *query;
+	MYSQL_RES *result;
+	GAsyncQueue *done;
 };
 
 struct tables_job {
@@ -92,6 +282,11 @@ struct db_table {
 	char* database;
 	char* table;
 	guint64 datalength;
+	/* Table statistics, zero when the server doesn't have them */
+	guint64 rows;
+	guint64 avg_row_length;
+	/* Changes when the table is rebuilt, NULL when the server doesn't say */
+	gchar *create_time;
 };
 
 struct schema_post {
@@ -27,10 +27,10 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <errno.h>
-#include <zlib.h>
 #include "common.h"
 #include "myloader.h"
 #include "config.h"
+#include "codec.h"
 
 guint commit_count= 1000;
 gchar *directory= NULL;
@@ -48,12 +48,14 @@ gboolean report = FALSE;
 
 static GMutex *init_mutex= NULL;
 static GMutex *db_mutex=NULL;
+static GMutex *dict_mutex=NULL;
+static GHashTable *dicts=NULL;
 
 guint errors= 0;
 void db_feeder( struct configuration *conf);
 void read_file_process( struct configuration *conf);
-gboolean read_data(FILE *file, gboolean is_compressed, GString *data, gboolean *eof);
-gboolean read_line(FILE *file, gboolean is_compressed, GString *data, gboolean *eof);
+gboolean read_data(struct codec_file *file, GString *data, gboolean *eof);
+gboolean read_line(FILE *file, GString *data, gboolean *eof);
 void restore_data(MYSQL *conn, char *database, char *table, const char *filename, gboolean is_schema, gboolean need_use);
 void *process_queue(struct thread_data *td);
 void add_schema(const gchar* filename, MYSQL *conn);
@@ -68,6 +70,7 @@ int restore_string(MYSQL *conn, char *database, char *table, GString *data, gboo
 void no_log(const gchar *log_domain, GLogLevelFlags log_level, const gchar *message, gpointer user_data);
 void set_verbose(guint verbosity);
 void create_database(MYSQL *conn, gchar *database);
+struct codec_dict *get_restore_dict(const gchar *path);
 void order_files(MYSQL *conn, struct configuration *conf);
 void add_index(struct table_data * td, struct configuration *conf);
 void show_report(GSList *table_data_list, GSList *schema_data_list);
@@ -180,6 +183,8 @@ int main(int argc, char *argv[]) {
 
 	init_mutex= g_mutex_new();
 	db_mutex=g_mutex_new();
+	dict_mutex=g_mutex_new();
+	dicts=g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)codec_dict_free);
 
 	if(db == NULL && source_db != NULL){
 		db = g_strdup(source_db);
@@ -323,6 +328,8 @@ int main(int argc, char *argv[]) {
 
 	g_mutex_free(init_mutex);
 	g_mutex_free(db_mutex);
+	g_hash_table_destroy(dicts);
+	g_mutex_free(dict_mutex);
 
 	return errors ? EXIT_FAILURE : EXIT_SUCCESS;
 }
@@ -663,29 +670,25 @@ void order_files(MYSQL *conn, struct configuration *conf) {
 				td->schemafile=new_datafile_filename(filename);
 			
 				gboolean eof= FALSE;
-				void *infile;
-				gboolean is_compressed= FALSE;
+				struct codec_file *infile;
 				GString *data= g_string_sized_new(512);
 				gchar* path= g_build_filename(directory, filename, NULL);
 
-				if (!g_str_has_suffix(path, ".gz")) {
-					infile= g_fopen(path, "r");
-					is_compressed= FALSE;
-				} else {
-					infile= (void*) gzopen(path, "r");
-					is_compressed= TRUE;
+				infile= codec_open(path, "r", codec_for_path(path), -1, 0);
+				if (!infile) {
+					g_critical("cannot open file %s (%d)", filename, errno);
+					exit(EXIT_FAILURE);
 				}
 
 				// Read the content of the schema file
 				while (eof == FALSE) {
-					read_data(infile, is_compressed, data, &eof);
+					if (!read_data(infile, data, &eof)) {
+						g_critical("error reading file %s: %s", filename, codec_error(infile));
+						exit(EXIT_FAILURE);
+					}
 				}
 
-				if (!is_compressed) {
-					fclose(infile);
-				} else {
-					gzclose((gzFile)infile);
-				}
+				codec_close(infile);
 
 				parsing_create_statement(data->str, td, conf);
 /*
@@ -924,13 +927,20 @@ void create_database(MYSQL *conn, gchar *database){
 	gchar* query = NULL;
 
 	if((db == NULL && source_db == NULL) || (db != NULL && source_db != NULL && !g_ascii_strcasecmp(db, source_db))){
-		const gchar* filename= g_strdup_printf("%s-schema-create.sql", db ? db : database);
-		const gchar* filenamegz= g_strdup_printf("%s-schema-create.sql.gz", db ? db : database);
+		gchar* filename= NULL;
+		int type;
+
+		for (type= CODEC_NONE; type < CODEC_COUNT; type++) {
+			filename= g_strdup_printf("%s-schema-create.sql%s", db ? db : database, codec_extension(type));
+			if (g_file_test (filename, G_FILE_TEST_EXISTS))
+				break;
+			g_free(filename);
+			filename= NULL;
+		}
 
-		if (g_file_test (filename, G_FILE_TEST_EXISTS)){
+		if (filename){
 			restore_data(conn, database, NULL, filename, TRUE, FALSE);
-		}else if (g_file_test (filenamegz, G_FILE_TEST_EXISTS)){
-			restore_data(conn, database, NULL, filenamegz, TRUE, FALSE);
+			g_free(filename);
 		}else{
 			query= g_strdup_printf("CREATE DATABASE `%s`", db ? db : database);
 			mysql_query(conn, query);
@@ -1291,22 +1301,35 @@ void *process_queue(struct thread_data *td) {
 	return NULL;
 }
 
+/* Loads the dictionary of a table the first time one of its chunks is restored, tables without one are remembered too */
+struct codec_dict *get_restore_dict(const gchar *path) {
+	gchar *dict_filename= codec_dict_filename(path);
+	struct codec_dict *dict= NULL;
+	gpointer found;
+
+	g_mutex_lock(dict_mutex);
+	if (g_hash_table_lookup_extended(dicts, dict_filename, NULL, &found)) {
+		dict= found;
+		g_free(dict_filename);
+	} else {
+		if (g_file_test(dict_filename, G_FILE_TEST_EXISTS))
+			dict= codec_dict_load(dict_filename);
+		g_hash_table_insert(dicts, dict_filename, dict);
+	}
+	g_mutex_unlock(dict_mutex);
+
+	return dict;
+}
+
 void restore_data(MYSQL *conn, char *database, char *table, const char *filename, gboolean is_schema, gboolean need_use) {
-	void *infile;
-	gboolean is_compressed= FALSE;
+	struct codec_file *infile;
 	gboolean eof= FALSE;
 	guint query_counter= 0;
 	GString *data= g_string_sized_new(1024);
 
 	gchar* path= g_build_filename(directory, filename, NULL);
 
-	if (!g_str_has_suffix(path, ".gz")) {
-		infile= g_fopen(path, "r");
-		is_compressed= FALSE;
-	} else {
-		infile= (void*) gzopen(path, "r");
-		is_compressed= TRUE;
-	}
+	infile= codec_open(path, "r", codec_for_path(path), -1, 0);
 
 	if (!infile) {
 		g_critical("cannot open file %s (%d)", filename, errno);
@@ -1314,6 +1337,10 @@ void restore_data(MYSQL *conn, char *database, char *table, const char *filename
 		return;
 	}
 
+	/* Chunks compressed with a table dictionary need it to be read */
+	if (!is_schema && codec_for_path(path) == CODEC_ZSTD)
+		codec_set_dict(infile, get_restore_dict(path));
+
 
 	if(need_use){
 		gchar *query= g_strdup_printf("USE `%s`", db ? db : database);
@@ -1333,7 +1360,7 @@ void restore_data(MYSQL *conn, char *database, char *table, const char *filename
 		mysql_query(conn, "START TRANSACTION");
 
 	while (eof == FALSE) {
-		if (read_data(infile, is_compressed, data, &eof)) {
+		if (read_data(infile, data, &eof)) {
 			// Search for ; in last 5 chars of line
 			if (g_strrstr(&data->str[data->len >= 5 ? data->len - 5 : 0], ";\n")) { 
 				if (mysql_real_query(conn, data->str, data->len)) {
@@ -1355,7 +1382,7 @@ void restore_data(MYSQL *conn, char *database, char *table, const char *filename
 				g_string_set_size(data, 0);
 			}
 		} else {
-			g_critical("error reading file %s (%d)", filename, errno);
+			g_critical("error reading file %s: %s", filename, codec_error(infile));
 			errors++;
 			return;
 		}
@@ -1367,11 +1394,7 @@ void restore_data(MYSQL *conn, char *database, char *table, const char *filename
 	}
 	g_string_free(data, TRUE);
 	g_free(path);
-	if (!is_compressed) {
-		fclose(infile);
-	} else {
-		gzclose((gzFile)infile);
-	}	
+	codec_close(infile);
 	return;
 }
 
@@ -1432,27 +1455,16 @@ int restore_string(MYSQL *conn, char *database, char *table, GString *statement,
         return 0;
 }
 
-gboolean read_data(FILE *file, gboolean is_compressed, GString *data, gboolean *eof) {
+gboolean read_data(struct codec_file *file, GString *data, gboolean *eof) {
 	char buffer[512];
 
 	do {
-		if (!is_compressed) {
-			if (fgets(buffer, 512, file) == NULL) {
-				if (feof(file)) {
-					*eof= TRUE;
-					buffer[0]= '\0';
-				} else {
-					return FALSE;
-				}
-			}
-		} else {
-			if (!gzgets((gzFile)file, buffer, 512)) {
-				if (gzeof((gzFile)file)) {
-					*eof= TRUE;
-					buffer[0]= '\0';
-				} else {
-					return FALSE;
-				}
+		if (!codec_gets(file, buffer, 512)) {
+			if (codec_eof(file)) {
+				*eof= TRUE;
+				buffer[0]= '\0';
+			} else {
+				return FALSE;
 			}
 		}
 		g_string_append(data, buffer);
@@ -1461,27 +1473,16 @@ gboolean read_data(FILE *file, gboolean is_compressed, GString *data, gboolean *
 	return TRUE;
 }
 
-gboolean read_line(FILE *file, gboolean is_compressed, GString *data, gboolean *eof) {
+gboolean read_line(FILE *file, GString *data, gboolean *eof) {
 	const int buffersize=512;
         char buffer[buffersize];
         do {
-                if (!is_compressed) {
-                        if (fgets(buffer, buffersize, file) == NULL) {
-                                if (feof(file)) {
-                                        *eof= TRUE;
-                                        buffer[0]= '\0';
-                                } else {
-                                        return FALSE;
-                                }
-                        }
-                } else {
-                        if (!gzgets((gzFile)file, buffer, buffersize)) {
-                                if (gzeof((gzFile)file)) {
-                                        *eof= TRUE;
-                                        buffer[0]= '\0';
-                                } else {
-                                        return FALSE;
-                                }
+                if (fgets(buffer, buffersize, file) == NULL) {
+                        if (feof(file)) {
+                                *eof= TRUE;
+                                buffer[0]= '\0';
+                        } else {
+                                return FALSE;
                         }
                 }
 		if (buffer[0] != '\n' && strlen(buffer)>0)
@@ -1503,7 +1504,7 @@ void read_file_process( struct configuration *conf){
 	g_message("Starting read file process");
 	while (!feof(infile) && !eof){
 		GString *data=g_string_new("");
-		read_line(infile,FALSE,data,&eof);
+		read_line(infile,data,&eof);
 		if (data != NULL && data->str != NULL && strlen(data->str) > 2){
 			g_string_append(statement,data->str);
 			int m=strlen(data->str)-2;